@@ -26,9 +26,63 @@ struct SchedInfo {
     int time_slice;
 };
 
+#define MAX_NODES 8
+
+struct NumaInfo {
+    int nodes;
+    int node;
+    unsigned long pages[MAX_NODES];
+    unsigned long free_pages[MAX_NODES];
+    unsigned long distance[MAX_NODES];
+};
+
+struct MergeInfo {
+    unsigned long scanned;
+    unsigned long merged;
+    unsigned long zero_merged;
+    unsigned long unmerged;
+    unsigned long shared;
+    unsigned long saved;
+};
+
+/* the kernel fills these in with the same layout, sizes in 4KB pages */
+struct MemStats {
+    uint64_t total_pages;
+    uint64_t free_pages;
+    uint64_t cached_pages;
+    uint64_t used_pages;
+    uint64_t store_pages;
+    uint64_t stored_pages;
+    uint64_t stack_peak;
+};
+
+struct ProcStats {
+    int32_t pid;
+    int32_t state;
+    uint64_t runtime;
+    uint64_t brk;
+    uint64_t resident_pages;
+    uint64_t shared_pages;
+    uint64_t swapped_pages;
+    uint64_t table_pages;
+    uint64_t minor_faults;
+    uint64_t cow_faults;
+    uint64_t zero_faults;
+    uint64_t swap_faults;
+    uint64_t stack_used;
+};
+
 #define ENTRY_AVAILABLE 0
 #define ENTRY_DELETED 0xe5
 
+#define MAP_WRITE 1
+#define MADV_DONTNEED 1
+#define MADV_POPULATE 2
+
+#define TRACE_STOP 0
+#define TRACE_START 1
+#define TRACE_DUMP 2
+
 void sleepu(uint64_t ticks);
 void exitu(void);
 void waitu(int pid);
@@ -56,5 +110,13 @@ void set_priority(int prio);
 int get_priority(void);
 unsigned long get_runtime(void);
 int get_sched_info(struct SchedInfo *info);
+void *mmap(int fd, uint32_t offset, uint32_t length, int flags);
+int munmap(void *addr, uint32_t length);
+int madvise(void *addr, uint64_t length, int advice);
+int get_numa_info(struct NumaInfo *info);
+int get_merge_info(struct MergeInfo *info);
+int get_mem_stats(struct MemStats *stats);
+int get_proc_stats(struct ProcStats *stats, int count);
+int alloc_trace(int command);
 
 #endif
@@ -240,6 +240,14 @@ global opendir
 global readdir
 global rmdir
 global get_sched_info
+global mmap
+global munmap
+global madvise
+global get_numa_info
+global get_merge_info
+global get_mem_stats
+global get_proc_stats
+global alloc_trace
 
 socket:
     sub rsp,8
@@ -348,6 +356,93 @@ get_sched_info:
     add rsp,8
     ret
 
+mmap:
+    sub rsp,32
+    mov eax,28
+    mov [rsp],rdi
+    mov [rsp+8],rsi
+    mov [rsp+16],rdx
+    mov [rsp+24],rcx
+    mov rdi,4
+    mov rsi,rsp
+    int 0x80
+    add rsp,32
+    ret
+
+munmap:
+    sub rsp,16
+    mov eax,29
+    mov [rsp],rdi
+    mov [rsp+8],rsi
+    mov rdi,2
+    mov rsi,rsp
+    int 0x80
+    add rsp,16
+    ret
+
+madvise:
+    sub rsp,24
+    mov eax,30
+    mov [rsp],rdi
+    mov [rsp+8],rsi
+    mov [rsp+16],rdx
+    mov rdi,3
+    mov rsi,rsp
+    int 0x80
+    add rsp,24
+    ret
+
+get_numa_info:
+    sub rsp,8
+    mov eax,31
+    mov [rsp],rdi
+    mov rdi,1
+    mov rsi,rsp
+    int 0x80
+    add rsp,8
+    ret
+
+get_merge_info:
+    sub rsp,8
+    mov eax,32
+    mov [rsp],rdi
+    mov rdi,1
+    mov rsi,rsp
+    int 0x80
+    add rsp,8
+    ret
+
+get_mem_stats:
+    sub rsp,8
+    mov eax,33
+    mov [rsp],rdi
+    mov rdi,1
+    mov rsi,rsp
+    int 0x80
+    add rsp,8
+    ret
+
+get_proc_stats:
+    sub rsp,16
+    mov eax,34
+    mov [rsp],rdi
+    mov [rsp+8],rsi
+    mov rdi,2
+    mov rsi,rsp
+    int 0x80
+    add rsp,16
+    ret
+
+alloc_trace:
+    sub rsp,8
+    mov eax,35
+    mov [rsp],rdi
+    mov rdi,1
+    mov rsi,rsp
+    int 0x80
+    add rsp,8
+    ret
+
 
 
 section .note.GNU-stack noalloc noexec nowrite progbits
@@ -4,12 +4,15 @@ import os, struct, glob, sys
 SECTOR_SIZE = 512
 TOTAL_SECTORS = 204_800  # ~100MB
 BYTES_PER_SECTOR = SECTOR_SIZE
-SECTORS_PER_CLUSTER = 4
-RESERVED_SECTORS = 1
+# the kernel maps file pages straight out of the image, so clusters are
+# a page long and the reserved sectors pad the data area to a page boundary
+PAGE_SECTORS = 4096 // BYTES_PER_SECTOR
+SECTORS_PER_CLUSTER = PAGE_SECTORS
 NUM_FATS = 2
 ROOT_ENTRIES = 512
 SECTORS_PER_FAT = 200
 ROOT_DIR_SECTORS = (ROOT_ENTRIES * 32 + BYTES_PER_SECTOR - 1) // BYTES_PER_SECTOR
+RESERVED_SECTORS = 1 + (-(1 + NUM_FATS * SECTORS_PER_FAT + ROOT_DIR_SECTORS)) % PAGE_SECTORS
 DATA_START_SECTOR = RESERVED_SECTORS + NUM_FATS * SECTORS_PER_FAT + ROOT_DIR_SECTORS
 CLUSTER_SIZE = SECTORS_PER_CLUSTER * BYTES_PER_SECTOR
 IMAGE_SIZE = TOTAL_SECTORS * BYTES_PER_SECTOR
@@ -1,19 +1,10 @@
 section .data
-global Tss
 
 Gdt64:
     dq 0
     dq 0x0020980000000000
     dq 0x0020f80000000000
     dq 0x0000f20000000000
-TssDesc:
-    dw TssLen-1
-    dw 0
-    db 0
-    db 0x89
-    db 0
-    db 0
-    dq 0
 
 Gdt64Len: equ $-Gdt64
 
@@ -21,14 +12,6 @@ global Gdt64Ptr
 Gdt64Ptr: dw Gdt64Len-1
           dq Gdt64
 
-Tss:
-    dd 0
-    dq 0xffff800000190000
-    times 88 db 0
-    dd TssLen
-
-TssLen: equ $-Tss
-
 section .text
 extern KMain
 global start64
@@ -37,18 +20,11 @@ start64:
     mov rax,Gdt64Ptr
     lgdt [rax]
 
-SetTss:
-    mov rax,Tss
-    mov rdi,TssDesc
-    mov [rdi+2],ax
-    shr rax,16
-    mov [rdi+4],al
-    shr rax,8
-    mov [rdi+7],al
-    shr rax,8
-    mov [rdi+8],eax
-    mov ax,0x20
-    ltr ax
+    ; make the kernel honour read-only user pages, so its writes through
+    ; user pointers take the copy-on-write path too
+    mov rax,cr0
+    or rax,(1<<16)
+    mov cr0,rax
 
 InitPIT:
     mov al,(1<<2)|(3<<4)
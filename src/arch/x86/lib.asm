@@ -3,6 +3,7 @@ global memset
 global memcpy
 global memmove
 global memcmp
+global memzero_nt
 
 memset:
     cld
@@ -11,6 +12,26 @@ memset:
     rep stosb
     ret
 
+; size is a multiple of 64, the stores bypass the cache
+memzero_nt:
+    xor eax,eax
+    mov ecx,esi
+    shr ecx,6
+.loop:
+    movnti [rdi],rax
+    movnti [rdi+8],rax
+    movnti [rdi+16],rax
+    movnti [rdi+24],rax
+    movnti [rdi+32],rax
+    movnti [rdi+40],rax
+    movnti [rdi+48],rax
+    movnti [rdi+56],rax
+    add rdi,64
+    dec ecx
+    jnz .loop
+    sfence
+    ret
+
 memcmp:
     cld
     xor eax,eax
@@ -1,46 +1,99 @@
 section .text
-    global start_aps
-    global send_ipi
-    extern cpu_count
-    extern cpu_mark_online
-
-%define LAPIC_BASE 0xfee00000
-%define ICR_LOW   0x300
-%define ICR_HIGH  0x310
-
-; Start application processors using INIT-SIPI
-start_aps:
-    mov eax, [rel cpu_count]
-    cmp eax, 1
-    jle .done
-    mov ecx, 1
-.loop:
-    mov rax, LAPIC_BASE
-    mov edx, ecx
-    shl edx, 24
-    mov dword [rax + ICR_HIGH], edx
-    mov dword [rax + ICR_LOW], 0x000C4500        ; INIT
-    mov dword [rax + ICR_HIGH], edx
-    mov dword [rax + ICR_LOW], 0x000C4608        ; SIPI
-    mov dword [rax + ICR_HIGH], edx
-    mov dword [rax + ICR_LOW], 0x000C4608        ; SIPI again
-    mov edi, ecx
-    call cpu_mark_online
-    inc ecx
-    cmp ecx, eax
-    jl .loop
-.done:
-    ret
-
-; send_ipi(cpu, vector)
-; rdi=cpu id, sil=vector
-send_ipi:
-    mov rax, LAPIC_BASE
-    mov edx, edi
-    shl edx, 24
-    mov dword [rax + ICR_HIGH], edx
-    movzx edx, sil
-    or edx, 0x00004000
-    mov dword [rax + ICR_LOW], edx
-    ret
+    global ap_trampoline
+    global ap_trampoline_args
+    global ap_trampoline_end
+
+; An AP starts in real mode at the page the SIPI vector names. start_aps
+; copies this code there, fills in the arguments at the end and sends the
+; SIPI. The AP goes through protected mode into long mode on the page
+; table given, then calls entry(cpu) on the stack given.
+
+%define TRAMPOLINE_BASE 0x8000
+%define TRAMPOLINE(x) ((x) - ap_trampoline + TRAMPOLINE_BASE)
+
+[BITS 16]
+ap_trampoline:
+    cli
+    xor ax,ax
+    mov ds,ax
+    mov es,ax
+    mov ss,ax
+
+    lgdt [TRAMPOLINE(TrampGdtPtr)]
+
+    mov eax,cr0
+    or eax,1
+    mov cr0,eax
+
+    jmp dword 0x10:TRAMPOLINE(ApStart32)
+
+[BITS 32]
+ApStart32:
+    mov ax,0x18
+    mov ds,ax
+    mov es,ax
+    mov ss,ax
+
+    ; enable PAE
+    mov eax,cr4
+    or eax,(1<<5)
+    mov cr4,eax
+
+    mov eax,[TRAMPOLINE(ap_trampoline_args)]
+    mov cr3,eax
+
+    ; enable LME
+    mov ecx,0xc0000080
+    rdmsr
+    or eax,(1<<8)
+    wrmsr
+
+    ; enable paging, with write protection as on the boot CPU
+    mov eax,cr0
+    or eax,(1<<31)|(1<<16)
+    mov cr0,eax
+
+    jmp 0x08:TRAMPOLINE(ApStart64)
+
+[BITS 64]
+ApStart64:
+    xor ax,ax
+    mov ds,ax
+    mov es,ax
+    mov ss,ax
+
+    mov rsp,[TRAMPOLINE(ap_trampoline_args)+8]
+    mov edi,[TRAMPOLINE(ap_trampoline_args)+4]
+    mov rax,[TRAMPOLINE(ap_trampoline_args)+16]
+    call rax
+
+.hang:
+    hlt
+    jmp .hang
+
+; the kernel code segment keeps selector 0x08 so nothing has to be
+; reloaded when the AP switches to its own GDT
+align 8
+TrampGdt:
+    dq 0
+    dq 0x0020980000000000
+    dq 0x00cf9a000000ffff
+    dq 0x00cf92000000ffff
+
+TrampGdtLen: equ $-TrampGdt
+
+TrampGdtPtr:
+    dw TrampGdtLen-1
+    dd TRAMPOLINE(TrampGdt)
+
+; struct TrampolineArgs: cr3, cpu, stack, entry
+align 8
+ap_trampoline_args:
+    dd 0
+    dd 0
+    dq 0
+    dq 0
+
+ap_trampoline_end:
+
 section .note.GNU-stack noalloc noexec nowrite progbits
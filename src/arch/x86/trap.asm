@@ -1,6 +1,7 @@
 
 section .text
 extern handler
+extern unlock_kernel
 global vector0
 global vector1
 global vector2
@@ -24,6 +25,7 @@ global vector33
 global vector39
 global vector40
 global vector41
+global vector255
 global sysint
 global eoi
 global read_isr
@@ -32,11 +34,21 @@ global load_cr3
 global pstart
 global read_cr2
 global read_cr3
+global read_cr4
+global write_cr4
+global invlpg
 global swap
 global TrapReturn
+global ProcessStart
 global in_byte
+global halt
 
 Trap:
+    ; GS_BASE holds the user value while user code runs
+    test byte [rsp+24],3
+    jz .from_kernel
+    swapgs
+.from_kernel:
     push rax
     push rbx  
     push rcx
@@ -74,6 +86,10 @@ TrapReturn:
     pop	rax       
 
     add rsp,16
+    test byte [rsp+8],3
+    jz .to_kernel
+    swapgs
+.to_kernel:
     iretq
 
 
@@ -186,6 +202,11 @@ vector41:
     push 41
     jmp Trap
 
+vector255:
+    push 0
+    push 255
+    jmp Trap
+
 sysint:
     push 0
     push 0x80
@@ -219,6 +240,23 @@ read_cr3:
     mov rax,cr3
     ret
 
+read_cr4:
+    mov rax,cr4
+    ret
+
+write_cr4:
+    mov cr4,rdi
+    ret
+
+invlpg:
+    invlpg [rdi]
+    ret
+
+; a new process is switched to holding the kernel lock
+ProcessStart:
+    call unlock_kernel
+    jmp TrapReturn
+
 pstart:
     mov rsp,rdi
     jmp TrapReturn
@@ -246,6 +284,12 @@ swap:
 in_byte:
     mov rdx,rdi
     in al,dx
+    ret
+
+halt:
+    sti
+    hlt
+    cli
     ret   
 
 
@@ -2,7 +2,6 @@
 #include "kernel/print.h"
 #include "kernel/keyboard.h" /* for in_byte */
 #include "kernel/memory.h"
-#include "kernel/trap.h" /* for read_cr3 */
 #include <string.h>
 
 /* Low level port I/O helpers.  Only what we need for the driver */
@@ -96,8 +95,7 @@ void e1000_init(void)
         if (id == 0x100E8086) {
             uint32_t bar0 = pci_read32(addr | 0x10);
             uint64_t mmio = bar0 & ~0xf;
-            uint64_t kmap = P2V(read_cr3());
-            map_pages(kmap, P2V(mmio), P2V(mmio + PAGE_SIZE), mmio, PTE_P|PTE_W);
+            /* the direct map always covers the 32-bit PCI hole */
             e1000_regs = (volatile uint32_t*)P2V(mmio);
             break;
         }
@@ -0,0 +1,113 @@
+#include "acpi.h"
+#include "memory.h"
+#include "lib.h"
+#include "stddef.h"
+#include "stdbool.h"
+
+/*
+ * Just enough ACPI to look up static tables. The firmware leaves the
+ * root pointer in the BIOS area below 1MB and the tables in reserved
+ * memory below 4GB, both of which the direct map covers.
+ */
+
+struct Rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+#define RSDP_V1_SIZE 20
+#define EBDA_SEGMENT 0x40e
+#define BIOS_ROM_START 0xe0000
+#define BIOS_ROM_END 0x100000
+
+static bool checksum_ok(void *table, uint32_t length)
+{
+    uint8_t *p = table;
+    uint8_t sum = 0;
+
+    for (uint32_t i = 0; i < length; i++)
+        sum += p[i];
+
+    return sum == 0;
+}
+
+static struct Rsdp* scan_rsdp(uint64_t start, uint64_t end)
+{
+    for (uint64_t pa = start; pa + sizeof(struct Rsdp) <= end; pa += 16) {
+        struct Rsdp *rsdp = (struct Rsdp*)P2V(pa);
+
+        if (memcmp(rsdp->signature, "RSD PTR ", 8) != 0)
+            continue;
+        if (!checksum_ok(rsdp, RSDP_V1_SIZE))
+            continue;
+        if (rsdp->revision >= 2 && !checksum_ok(rsdp, rsdp->length))
+            continue;
+
+        return rsdp;
+    }
+
+    return NULL;
+}
+
+static struct Rsdp* find_rsdp(void)
+{
+    uint64_t ebda = (uint64_t)*(uint16_t*)P2V(EBDA_SEGMENT) << 4;
+    struct Rsdp *rsdp = NULL;
+
+    if (ebda != 0)
+        rsdp = scan_rsdp(ebda, ebda + 1024);
+    if (rsdp == NULL)
+        rsdp = scan_rsdp(BIOS_ROM_START, BIOS_ROM_END);
+
+    return rsdp;
+}
+
+static struct AcpiHeader* check_table(uint64_t pa, const char *signature)
+{
+    struct AcpiHeader *table = (struct AcpiHeader*)P2V(pa);
+
+    if (pa == 0 || memcmp(table->signature, (void*)signature, 4) != 0)
+        return NULL;
+
+    return checksum_ok(table, table->length) ? table : NULL;
+}
+
+/* the table with the given signature, or NULL if the firmware has none */
+struct AcpiHeader* acpi_find_table(const char *signature)
+{
+    struct Rsdp *rsdp = find_rsdp();
+    struct AcpiHeader *table = NULL;
+
+    if (rsdp == NULL)
+        return NULL;
+
+    if (rsdp->revision >= 2 && rsdp->xsdt_address != 0) {
+        struct AcpiHeader *xsdt = check_table(rsdp->xsdt_address, "XSDT");
+        if (xsdt != NULL) {
+            int count = (xsdt->length - sizeof(struct AcpiHeader)) / 8;
+            uint64_t *entries = (uint64_t*)(xsdt + 1);
+
+            for (int i = 0; i < count && table == NULL; i++)
+                table = check_table(entries[i], signature);
+            return table;
+        }
+    }
+
+    struct AcpiHeader *rsdt = check_table(rsdp->rsdt_address, "RSDT");
+    if (rsdt != NULL) {
+        int count = (rsdt->length - sizeof(struct AcpiHeader)) / 4;
+        uint32_t *entries = (uint32_t*)(rsdt + 1);
+
+        for (int i = 0; i < count && table == NULL; i++)
+            table = check_table(entries[i], signature);
+    }
+
+    return table;
+}
@@ -0,0 +1,78 @@
+#ifndef _ACPI_H_
+#define _ACPI_H_
+
+#include "stdint.h"
+
+struct AcpiHeader {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+/* static resource affinity table, followed by a list of entries */
+struct Srat {
+    struct AcpiHeader header;
+    uint32_t reserved1;
+    uint64_t reserved2;
+} __attribute__((packed));
+
+#define SRAT_CPU_AFFINITY 0
+#define SRAT_MEMORY_AFFINITY 1
+#define SRAT_X2APIC_AFFINITY 2
+#define SRAT_ENABLED 1
+
+struct SratEntry {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+struct SratCpuAffinity {
+    uint8_t type;
+    uint8_t length;
+    uint8_t domain_low;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t domain_high[3];
+    uint32_t clock_domain;
+} __attribute__((packed));
+
+struct SratMemoryAffinity {
+    uint8_t type;
+    uint8_t length;
+    uint32_t domain;
+    uint16_t reserved1;
+    uint64_t address;
+    uint64_t length_bytes;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} __attribute__((packed));
+
+struct SratX2apicAffinity {
+    uint8_t type;
+    uint8_t length;
+    uint16_t reserved1;
+    uint32_t domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} __attribute__((packed));
+
+/* system locality distance table, a localities x localities matrix */
+struct Slit {
+    struct AcpiHeader header;
+    uint64_t localities;
+    uint8_t distance[];
+} __attribute__((packed));
+
+struct AcpiHeader* acpi_find_table(const char *signature);
+
+#endif
@@ -1,22 +1,31 @@
 #include "cpu.h"
 #include "lib.h"
-#include "arch/x86/smp.h"
+#include "smp.h"
 #include "memory.h"
 
 struct CPU cpus[MAX_CPU];
 int cpu_count = 1;
 int cpu_online_count = 0;
 
-static int current_cpu_id = 0;
+static struct SpinLock shootdown_lock;
+static struct SpinLock kernel_lock;
+static volatile int kernel_lock_owner = -1;
+static uint8_t fault_stacks[MAX_CPU][FAULT_STACK_SIZE] __attribute__((aligned(16)));
 
-static int detect_cpus(void)
+void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *regs)
 {
-    unsigned int eax, ebx, ecx, edx;
     __asm__ volatile("cpuid"
-                     : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
-                     : "a"(1), "c"(0));
+                     : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3])
+                     : "a"(leaf), "c"(subleaf));
+}
+
+static int detect_cpus(void)
+{
+    uint32_t regs[4];
+
+    cpuid(1, 0, regs);
 
-    int n = (ebx >> 16) & 0xff;
+    int n = (regs[1] >> 16) & 0xff;
     if (n < 1)
         n = 1;
     if (n > MAX_CPU)
@@ -24,44 +33,163 @@ static int detect_cpus(void)
     return n;
 }
 
-struct CPU* cpu_current(void)
+static void write_msr(uint32_t msr, uint64_t value)
 {
-    return &cpus[current_cpu_id];
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
 }
 
 void cpu_mark_online(int id)
 {
     if (!cpus[id].online) {
-        cpus[id].online = 1;
         cpu_online_count++;
+        /* what the CPU set up is seen before the CPU itself */
+        __sync_synchronize();
+        cpus[id].online = 1;
+    }
+}
+
+/*
+ * Run on the CPU itself before it calls cpu_current. The selectors are
+ * the ones the boot GDT and the trampoline use, so CS stays valid.
+ */
+void init_cpu_local(int id)
+{
+    struct CPU *cpu = &cpus[id];
+    uint64_t tss = (uint64_t)&cpu->tss;
+    struct GdtPtr gdt_pointer;
+
+    cpu->gdt[0] = 0;
+    cpu->gdt[1] = 0x0020980000000000;
+    cpu->gdt[2] = 0x0020f80000000000;
+    cpu->gdt[3] = 0x0000f20000000000;
+    cpu->gdt[4] = (sizeof(struct TSS) - 1) | (tss & 0xffffff) << 16 |
+                  (uint64_t)0x89 << 40 | ((tss >> 24) & 0xff) << 56;
+    cpu->gdt[5] = tss >> 32;
+
+    /* a double fault may come from a kernel stack which overflowed */
+    cpu->tss.ist1 = (uint64_t)fault_stacks[id] + FAULT_STACK_SIZE;
+    cpu->tss.iopb = sizeof(struct TSS);
+
+    gdt_pointer.limit = sizeof(cpu->gdt) - 1;
+    gdt_pointer.addr = (uint64_t)cpu->gdt;
+    __asm__ volatile("lgdt %0" : : "m"(gdt_pointer));
+    __asm__ volatile("ltr %w0" : : "r"(TSS_SELECTOR));
+
+    write_msr(MSR_GS_BASE, (uint64_t)cpu);
+    write_msr(MSR_KERNEL_GS_BASE, 0);
+}
+
+/*
+ * One lock for the whole kernel. A CPU takes it when it comes in from
+ * user mode or out of the halted idle loop and drops it on the way back.
+ * It stays held across a process switch, the process switched to drops
+ * it on its own way out.
+ */
+void lock_kernel(void)
+{
+    /* the CPU holding the lock may be waiting for us to flush */
+    while (!spin_trylock(&kernel_lock)) {
+        handle_tlb_request();
+        __asm__ volatile("pause");
     }
-    current_cpu_id = id;
+    kernel_lock_owner = cpu_id();
+}
+
+void unlock_kernel(void)
+{
+    kernel_lock_owner = -1;
+    spin_unlock(&kernel_lock);
+}
+
+bool holds_kernel_lock(void)
+{
+    return kernel_lock_owner == cpu_id();
 }
 
-static void broadcast_ipi(unsigned char vec)
+/* wake the CPUs sitting in their idle loop, they take over ready processes */
+void reschedule_other_cpus(void)
 {
     for (int i = 0; i < cpu_count; i++) {
-        if (!cpus[i].online || i == current_cpu_id)
+        struct ProcessControl *pc = &cpus[i].pc;
+
+        if (!cpus[i].online || i == cpu_id() || pc->current_process != pc->idle_process)
             continue;
-        send_ipi(i, vec);
+
+        pc->need_resched = 1;
+        send_ipi(i, RESCHEDULE_VECTOR);
     }
 }
 
-void reschedule_other_cpus(void)
+/* flush the range another CPU asked for, from the IPI or while waiting */
+void handle_tlb_request(void)
 {
-    broadcast_ipi(40);
+    struct TlbRequest *request = &cpu_current()->tlb.request;
+
+    if (request->pending) {
+        flush_tlb_local(request->map, request->start, request->end, request->tlb_gen);
+        __sync_synchronize();
+        request->pending = 0;
+    }
 }
 
-void tlb_shootdown(void)
+/*
+ * Flush [start, end) of map on every CPU which has map loaded and wait
+ * until they are done. CPUs which only have it cached under a PCID
+ * catch up through the generation when they switch back to it. Kernel
+ * ranges are in every map, so all CPUs flush them.
+ */
+void tlb_shootdown(uint64_t map, uint64_t start, uint64_t end)
 {
-    broadcast_ipi(41);
+    struct CPU *cpu = cpu_current();
+    bool kernel = start >= KERNEL_BASE;
+    uint64_t tlb_gen = 0;
+
+    if (start >= end)
+        return;
+
+    /* the CPU holding the lock may be waiting for us */
+    while (!spin_trylock(&shootdown_lock)) {
+        handle_tlb_request();
+        __asm__ volatile("pause");
+    }
+
+    if (!kernel)
+        tlb_gen = flush_tlb_begin(map);
+    flush_tlb_local(map, start, end, tlb_gen);
+
+    for (int i = 0; i < cpu_count; i++) {
+        struct TlbRequest *request = &cpus[i].tlb.request;
+
+        if (&cpus[i] == cpu || !cpus[i].online)
+            continue;
+        if (!kernel && cpus[i].tlb.active_map != map)
+            continue;
+
+        request->map = map;
+        request->start = start;
+        request->end = end;
+        request->tlb_gen = tlb_gen;
+        __sync_synchronize();
+        request->pending = 1;
+        send_ipi(i, TLB_VECTOR);
+    }
+
+    for (int i = 0; i < cpu_count; i++) {
+        while (cpus[i].tlb.request.pending)
+            __asm__ volatile("pause");
+    }
+
+    spin_unlock(&shootdown_lock);
 }
 
 void cpu_init(void)
 {
     memset(cpus, 0, sizeof(cpus));
     cpu_count = detect_cpus();
-    for (int i = 0; i < cpu_count; i++)
+    for (int i = 0; i < cpu_count; i++) {
+        cpus[i].self = &cpus[i];
         cpus[i].id = i;
+    }
+    init_cpu_local(0);
     cpu_mark_online(0);
 }
@@ -2,23 +2,85 @@
 #define _CPU_H_
 
 #include "process.h"
+#include "memory.h"
+#include "stddef.h"
 
 #define MAX_CPU 4
 
+#define MSR_GS_BASE 0xc0000101
+#define MSR_KERNEL_GS_BASE 0xc0000102
+
+/* null, kernel code, user code, user data and the 16 byte TSS descriptor */
+#define GDT_ENTRIES 6
+#define TSS_SELECTOR 0x20
+#define FAULT_STACK_SIZE 8192
+
+/*
+ * While a CPU runs kernel code its GS_BASE points at its struct CPU,
+ * the user value is swapped in on the way out and back in on entry.
+ * The first field points back at the struct, so the current CPU and
+ * any field of it are a single load through GS.
+ */
 struct CPU {
+    struct CPU *self;
     int id;
     int online;
+    int node;
     struct ProcessControl pc;
+    struct PageCache page_cache;
+    struct TlbState tlb;
+    /* loading the TSS marks its descriptor busy, so every CPU has its
+       own GDT next to its own TSS */
+    uint64_t gdt[GDT_ENTRIES];
+    struct TSS tss;
 };
 
+struct GdtPtr {
+    uint16_t limit;
+    uint64_t addr;
+} __attribute__((packed));
+
 extern struct CPU cpus[MAX_CPU];
 extern int cpu_count;
 extern int cpu_online_count;
 
+void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *regs);
 void cpu_init(void);
 void cpu_mark_online(int id);
-struct CPU* cpu_current(void);
+void init_cpu_local(int id);
+void lock_kernel(void);
+void unlock_kernel(void);
+bool holds_kernel_lock(void);
 void reschedule_other_cpus(void);
-void tlb_shootdown(void);
+void tlb_shootdown(uint64_t map, uint64_t start, uint64_t end);
+void handle_tlb_request(void);
+
+static inline struct CPU* cpu_current(void)
+{
+    struct CPU *cpu;
+
+    __asm__ volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+static inline int cpu_id(void)
+{
+    int id;
+
+    __asm__ volatile("mov %%gs:%c1, %0" : "=r"(id) : "i"(offsetof(struct CPU, id)));
+    return id;
+}
+
+static inline struct Process* cpu_current_process(void)
+{
+    struct Process *proc;
+
+    __asm__ volatile("mov %%gs:%c1, %0" : "=r"(proc) : "i"(offsetof(struct CPU, pc.current_process)));
+    return proc;
+}
+
+/* count an event in a uint64_t field of the current CPU */
+#define cpu_inc(field) \
+    __asm__ volatile("incq %%gs:%c0" : : "i"(offsetof(struct CPU, field)) : "memory")
 
 #endif
@@ -4,6 +4,8 @@
 #include "lib.h"
 #include "debug.h"
 #include "cpu.h"
+#include "file.h"
+#include "mmap.h"
 
 struct Elf64_Ehdr {
     unsigned char e_ident[16];
@@ -43,67 +45,98 @@ static inline uint64_t align_up(uint64_t val)
     return (val + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 }
 
-bool load_elf(struct Process *proc, void *image)
+static bool read_header(struct FileCursor *file, struct Elf64_Ehdr *eh)
 {
-    struct Elf64_Ehdr *eh = (struct Elf64_Ehdr*)image;
-    if (eh->e_ident[0] != 0x7f || eh->e_ident[1] != 'E' ||
-        eh->e_ident[2] != 'L' || eh->e_ident[3] != 'F')
+    if (read_file_at(file, eh, 0, sizeof(*eh)) != sizeof(*eh))
         return false;
 
-    /* free old memory */
-    if (proc->brk > 0x400000)
-        free_vm(proc->page_map, proc->brk - 0x400000);
+    return eh->e_ident[0] == 0x7f && eh->e_ident[1] == 'E' &&
+           eh->e_ident[2] == 'L' && eh->e_ident[3] == 'F';
+}
 
-    uint64_t max_end = 0;
-    struct Elf64_Phdr *ph = (struct Elf64_Phdr*)((char*)image + eh->e_phoff);
-    for (int i = 0; i < eh->e_phnum; i++, ph++) {
-        if (ph->p_type != PT_LOAD)
-            continue;
-        uint64_t start = PA_DOWN(ph->p_vaddr);
-        uint64_t end = PA_UP(ph->p_vaddr + ph->p_memsz);
-        for (uint64_t addr = start; addr < end; addr += PAGE_SIZE) {
-            void *page = kalloc();
-            if (!page)
-                return false;
-            memset(page, 0, PAGE_SIZE);
-            uint32_t attr = PTE_P | PTE_U;
-            if (ph->p_flags & PF_W)
-                attr |= PTE_W;
-            if (!map_pages(proc->page_map, addr, addr + PAGE_SIZE,
-                            V2P(page), attr))
-                return false;
-        }
-        if (ph->p_vaddr + ph->p_memsz > max_end)
-            max_end = ph->p_vaddr + ph->p_memsz;
+/* a segment lies in the file and below the mmap region, with its stack */
+static bool check_segment(struct Elf64_Phdr *ph, uint32_t file_size)
+{
+    if (ph->p_vaddr < 0x400000 || ph->p_memsz > MMAP_BASE ||
+        ph->p_vaddr > MMAP_BASE - ph->p_memsz ||
+        align_up(ph->p_vaddr + ph->p_memsz) + PAGE_SIZE > MMAP_BASE)
+        return false;
+
+    if (ph->p_filesz > ph->p_memsz || ph->p_filesz > file_size ||
+        ph->p_offset > file_size - ph->p_filesz)
+        return false;
+
+    return ph->p_offset % SMALL_PAGE_SIZE == ph->p_vaddr % SMALL_PAGE_SIZE;
+}
+
+/*
+ * exec checks the file with this before it drops the old image, so a
+ * bad file leaves the caller as it was.
+ */
+bool check_elf(struct Process *proc, int fd)
+{
+    struct FileCursor file;
+    struct Elf64_Ehdr eh;
+    struct Elf64_Phdr ph;
+
+    if (!get_file_cursor(proc, fd, &file) || !read_header(&file, &eh))
+        return false;
+
+    for (int i = 0; i < eh.e_phnum; i++) {
+        uint32_t offset = eh.e_phoff + i * sizeof(ph);
+        if (read_file_at(&file, &ph, offset, sizeof(ph)) != sizeof(ph))
+            return false;
+        if (ph.p_type == PT_LOAD && !check_segment(&ph, file.file_size))
+            return false;
     }
 
-    uint64_t old = read_cr3();
-    switch_vm(proc->page_map);
-    ph = (struct Elf64_Phdr*)((char*)image + eh->e_phoff);
-    for (int i = 0; i < eh->e_phnum; i++, ph++) {
-        if (ph->p_type != PT_LOAD)
+    return true;
+}
+
+/*
+ * The segments are only recorded here, their pages are read from the
+ * file by the page fault handler when the program first touches them.
+ * The file has been through check_elf.
+ */
+bool load_elf(struct Process *proc, int fd)
+{
+    struct FileCursor file;
+    struct Elf64_Ehdr eh;
+    struct Elf64_Phdr ph;
+
+    if (!get_file_cursor(proc, fd, &file) || !read_header(&file, &eh))
+        return false;
+
+    /* drop the old image, the page tables are reused */
+    if (proc->brk > 0x400000)
+        free_pages(proc->page_map, 0x400000, PA_UP(proc->brk));
+
+    uint64_t max_end = 0;
+    for (int i = 0; i < eh.e_phnum; i++) {
+        uint32_t offset = eh.e_phoff + i * sizeof(ph);
+        if (read_file_at(&file, &ph, offset, sizeof(ph)) != sizeof(ph))
+            return false;
+        if (ph.p_type != PT_LOAD)
             continue;
-        memcpy((void*)ph->p_vaddr, (char*)image + ph->p_offset, ph->p_filesz);
-        if (ph->p_memsz > ph->p_filesz)
-            memset((void*)(ph->p_vaddr + ph->p_filesz), 0,
-                   ph->p_memsz - ph->p_filesz);
+        uint32_t flags = 0;
+        if (ph.p_flags & PF_W)
+            flags |= VM_WRITE;
+        if (!add_vm_segment(proc, &file, ph.p_vaddr, ph.p_memsz, ph.p_offset, ph.p_filesz, flags))
+            return false;
+        if (ph.p_vaddr + ph.p_memsz > max_end)
+            max_end = ph.p_vaddr + ph.p_memsz;
     }
-    switch_vm(P2V(old));
 
-    /* setup stack */
-    uint64_t stack_base = align_up(max_end);
-    void *page = kalloc();
-    if (!page)
-        return false;
-    memset(page, 0, PAGE_SIZE);
-    if (!map_pages(proc->page_map, stack_base, stack_base + PAGE_SIZE,
-                   V2P(page), PTE_P|PTE_W|PTE_U))
+    /* setup stack, only the top page is populated up front and the
+       rest is faulted in below it */
+    uint64_t stack_top = align_up(max_end) + PAGE_SIZE;
+    if (!alloc_uvm(proc->page_map, stack_top - SMALL_PAGE_SIZE, stack_top,
+                   PTE_P|PTE_W|PTE_U))
         return false;
 
-    proc->tf->rip = eh->e_entry;
-    proc->tf->rsp = stack_base + PAGE_SIZE;
-    proc->brk = stack_base + PAGE_SIZE;
+    proc->tf->rip = eh.e_entry;
+    proc->tf->rsp = stack_top;
+    proc->brk = stack_top;
 
     return true;
 }
-
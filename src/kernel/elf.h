@@ -6,6 +6,7 @@
 
 struct Process;
 
-bool load_elf(struct Process *proc, void *image);
+bool check_elf(struct Process *proc, int fd);
+bool load_elf(struct Process *proc, int fd);
 
 #endif
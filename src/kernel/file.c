@@ -4,9 +4,10 @@
 #include "print.h"
 #include "lib.h"
 #include "debug.h"
+#include "slab.h"
 
-static struct FCB *fcb_table;
-static struct FileDesc *file_desc_table;
+static struct KmemCache *fcb_cache;
+static struct KmemCache *file_desc_cache;
 
 static struct BPB* get_fs_bpb(void)
 {
@@ -215,36 +216,48 @@ static uint32_t search_file(char *path)
     return idx;
 }
 
-static uint32_t get_fcb(uint32_t index)
-{
-    struct DirEntry *dir_table;
-
-    if (fcb_table[index].count == 0) {        
-        dir_table = get_root_directory();
-        fcb_table[index].dir_index = index;
-        fcb_table[index].file_size = dir_table[index].file_size;
-        fcb_table[index].cluster_index = dir_table[index].cluster_index;
-        memcpy(&fcb_table[index].name, &dir_table[index].name, 8);
-        memcpy(&fcb_table[index].ext, &dir_table[index].ext, 3);
-    }
-    
-    fcb_table[index].count++;
-
-    return index;
-}
-
 static void put_fcb(struct FCB *fcb)
 {
     ASSERT(fcb->count > 0);
     fcb->count--;
     if (fcb->count == 0)
-        memset(fcb, 0, sizeof(struct FCB));
+        kmem_cache_free(fcb_cache, fcb);
+}
+
+static int install_file_desc(struct Process *proc, int fd, struct DirEntry *entry)
+{
+    struct FCB *fcb;
+    struct FileDesc *desc;
+
+    fcb = kmem_cache_alloc(fcb_cache);
+    if (fcb == NULL)
+        return -1;
+
+    desc = kmem_cache_alloc(file_desc_cache);
+    if (desc == NULL) {
+        kmem_cache_free(fcb_cache, fcb);
+        return -1;
+    }
+
+    memset(fcb, 0, sizeof(struct FCB));
+    memcpy(fcb->name, entry->name, 8);
+    memcpy(fcb->ext, entry->ext, 3);
+    fcb->cluster_index = entry->cluster_index;
+    fcb->file_size = entry->file_size;
+    fcb->attributes = entry->attributes;
+    fcb->count = 1;
+
+    memset(desc, 0, sizeof(struct FileDesc));
+    desc->fcb = fcb;
+    desc->count = 1;
+    proc->file[fd] = desc;
+
+    return fd;
 }
 
 int open_file(struct Process *proc, char *path_name)
 {
     int fd = -1;
-    int file_desc_index = -1;
     struct DirEntry entry;
     uint32_t dir_cluster;
 
@@ -259,46 +272,12 @@ int open_file(struct Process *proc, char *path_name)
         return -1;
     }
 
-    for (int i = 0; i < PAGE_SIZE / sizeof(struct FileDesc); i++) {
-        if (file_desc_table[i].fcb == NULL) {
-            file_desc_index = i;
-            break;
-        }
-    }
-
-    if (file_desc_index == -1)
-        return -1;
-
     if (!find_entry(path_name, &entry, &dir_cluster, NULL))
         return -1;
     if ((entry.attributes & 0x10) != 0)
         return -1;
 
-    struct FCB *fcb = NULL;
-    for (uint32_t i = 0; i < PAGE_SIZE / sizeof(struct FCB); i++) {
-        if (fcb_table[i].count == 0) {
-            fcb = &fcb_table[i];
-            break;
-        }
-    }
-    if (fcb == NULL)
-        return -1;
-
-    memset(fcb, 0, sizeof(struct FCB));
-    memcpy(fcb->name, entry.name, 8);
-    memcpy(fcb->ext, entry.ext, 3);
-    fcb->cluster_index = entry.cluster_index;
-    fcb->file_size = entry.file_size;
-    fcb->count = 1;
-    fcb->attributes = entry.attributes;
-    fcb->dir_index = 0;
-
-    memset(&file_desc_table[file_desc_index], 0, sizeof(struct FileDesc));
-    file_desc_table[file_desc_index].fcb = fcb;
-    file_desc_table[file_desc_index].count = 1;
-    proc->file[fd] = &file_desc_table[file_desc_index];
-
-    return fd;
+    return install_file_desc(proc, fd, &entry);
 }
 
 static uint32_t read_raw_data(uint32_t cluster_index, char *buffer, uint32_t position, uint32_t size)
@@ -470,11 +449,13 @@ int read_file(struct Process *proc, int fd, void *buffer, uint32_t size)
 
 void close_file(struct Process *proc, int fd)
 {
-    put_fcb(proc->file[fd]->fcb);
-    proc->file[fd]->count--;
+    struct FileDesc *desc = proc->file[fd];
 
-    if (proc->file[fd]->count == 0) {
-        proc->file[fd]->fcb = NULL;
+    put_fcb(desc->fcb);
+    desc->count--;
+
+    if (desc->count == 0) {
+        kmem_cache_free(file_desc_cache, desc);
     }
 
     proc->file[fd] = NULL;
@@ -608,7 +589,6 @@ int mkdir(char *path)
 int opendir(struct Process *proc, char *path)
 {
     int fd = -1;
-    int file_desc_index = -1;
     struct DirEntry entry;
     uint32_t dir_cluster;
 
@@ -618,36 +598,12 @@ int opendir(struct Process *proc, char *path)
     if (fd == -1)
         return -1;
 
-    for (int i = 0; i < PAGE_SIZE / sizeof(struct FileDesc); i++) {
-        if (file_desc_table[i].fcb == NULL) { file_desc_index = i; break; }
-    }
-    if (file_desc_index == -1)
-        return -1;
-
     if (!find_entry(path, &entry, &dir_cluster, NULL))
         return -1;
     if ((entry.attributes & 0x10) == 0)
         return -1;
 
-    struct FCB *fcb = NULL;
-    for (uint32_t i = 0; i < PAGE_SIZE / sizeof(struct FCB); i++) {
-        if (fcb_table[i].count == 0) { fcb = &fcb_table[i]; break; }
-    }
-    if (!fcb) return -1;
-    memset(fcb,0,sizeof(struct FCB));
-    memcpy(fcb->name, entry.name,8);
-    memcpy(fcb->ext, entry.ext,3);
-    fcb->cluster_index = entry.cluster_index;
-    fcb->file_size = entry.file_size;
-    fcb->attributes = entry.attributes;
-    fcb->count = 1;
-
-    memset(&file_desc_table[file_desc_index],0,sizeof(struct FileDesc));
-    file_desc_table[file_desc_index].fcb = fcb;
-    file_desc_table[file_desc_index].count = 1;
-    proc->file[fd] = &file_desc_table[file_desc_index];
-
-    return fd;
+    return install_file_desc(proc, fd, &entry);
 }
 
 int readdir(struct Process *proc, int fd, struct DirEntry *entry)
@@ -689,30 +645,92 @@ int rmdir(char *path)
     return 0;
 }
 
-static bool init_fcb(void)
+bool get_file_cursor(struct Process *proc, int fd, struct FileCursor *cursor)
 {
-    fcb_table = (struct FCB*)kalloc();
+    if (fd < 0 || fd >= 100 || proc->file[fd] == NULL)
+        return false;
 
-    if (fcb_table == NULL) {
-	    return false;
-    }
+    struct FCB *fcb = proc->file[fd]->fcb;
+    if ((fcb->attributes & 0x10) != 0)
+        return false;
 
-    memset(fcb_table, 0, PAGE_SIZE);
+    cursor->first_cluster = fcb->cluster_index;
+    cursor->file_size = fcb->file_size;
+    cursor->position = 0;
+    cursor->cluster = fcb->cluster_index;
 
     return true;
 }
 
-static bool init_file_desc(void)
+/* move the cursor to the cluster holding offset */
+static bool seek_cluster(struct FileCursor *cursor, uint32_t offset)
 {
-    file_desc_table = (struct FileDesc*)kalloc();
+    uint32_t cluster_size = get_cluster_size();
+
+    if (offset < cursor->position) {
+        cursor->position = 0;
+        cursor->cluster = cursor->first_cluster;
+    }
 
-    if (file_desc_table == NULL) {
-	    return false;
+    while (cursor->cluster >= 2 && cursor->cluster < 0xfff7 &&
+           offset >= cursor->position + cluster_size) {
+        cursor->cluster = get_cluster_value(cursor->cluster);
+        cursor->position += cluster_size;
     }
 
-    memset(file_desc_table, 0, PAGE_SIZE);
+    return cursor->cluster >= 2 && cursor->cluster < 0xfff7;
+}
 
-    return true;
+/*
+ * Physical address of bytes [offset, offset+size) of the file when they
+ * are stored back to back in the image, 0 otherwise. Clusters with
+ * consecutive numbers are adjacent in the data area.
+ */
+uint64_t get_file_extent(struct FileCursor *cursor, uint32_t offset, uint32_t size)
+{
+    uint32_t cluster_size = get_cluster_size();
+
+    if (offset + size > cursor->file_size || !seek_cluster(cursor, offset))
+        return 0;
+
+    uint32_t index = cursor->cluster;
+    uint32_t covered = cursor->position + cluster_size - offset;
+
+    while (covered < size) {
+        uint32_t next = get_cluster_value(index);
+        if (next != index + 1)
+            return 0;
+        index = next;
+        covered += cluster_size;
+    }
+
+    return V2P((uint64_t)get_fs_bpb() + get_cluster_offset(cursor->cluster) +
+               (offset - cursor->position));
+}
+
+uint32_t read_file_at(struct FileCursor *cursor, void *buffer, uint32_t offset, uint32_t size)
+{
+    uint32_t cluster_size = get_cluster_size();
+    uint32_t read_size = 0;
+
+    if (offset >= cursor->file_size)
+        return 0;
+    if (size > cursor->file_size - offset)
+        size = cursor->file_size - offset;
+
+    while (read_size < size && seek_cluster(cursor, offset + read_size)) {
+        uint32_t start = offset + read_size - cursor->position;
+        uint32_t count = cluster_size - start;
+        char *data = (char*)((uint64_t)get_fs_bpb() + get_cluster_offset(cursor->cluster));
+
+        if (count > size - read_size)
+            count = size - read_size;
+
+        memcpy((char*)buffer + read_size, data + start, count);
+        read_size += count;
+    }
+
+    return read_size;
 }
 
 void init_fs(void)
@@ -724,7 +742,7 @@ void init_fs(void)
         ASSERT(0);
     }
     
-    ASSERT(init_fcb());
-    ASSERT(init_file_desc());
+    fcb_cache = kmem_cache_create("fcb", sizeof(struct FCB));
+    file_desc_cache = kmem_cache_create("file_desc", sizeof(struct FileDesc));
 }
 
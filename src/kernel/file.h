@@ -2,6 +2,7 @@
 #define _FILE_H_
 
 #include "stdint.h"
+#include "stdbool.h"
 
 struct BPB {
     uint8_t jump[3];
@@ -60,7 +61,17 @@ struct FileDesc {
 
 struct Process;
 
+/* a file as seen by the pager, the cursor remembers the last cluster
+   looked up so sequential accesses do not walk the chain again */
+struct FileCursor {
+    uint32_t first_cluster;
+    uint32_t file_size;
+    uint32_t position;
+    uint32_t cluster;
+};
+
 #define FS_BASE 0x30000000
+#define FS_SIZE (100*1024*1024)
 #define ENTRY_EMPTY 0
 #define ENTRY_DELETED 0xe5
 
@@ -78,5 +89,8 @@ int mkdir(char *path);
 int opendir(struct Process *proc, char *path);
 int readdir(struct Process *proc, int fd, struct DirEntry *entry);
 int rmdir(char *path);
+bool get_file_cursor(struct Process *proc, int fd, struct FileCursor *cursor);
+uint64_t get_file_extent(struct FileCursor *cursor, uint32_t offset, uint32_t size);
+uint32_t read_file_at(struct FileCursor *cursor, void *buffer, uint32_t offset, uint32_t size);
 
 #endif
@@ -0,0 +1,298 @@
+#include "ksm.h"
+#include "memory.h"
+#include "process.h"
+#include "mmap.h"
+#include "cpu.h"
+#include "trap.h"
+#include "lib.h"
+#include "debug.h"
+
+/*
+ * Same-page merging. The idle loop hashes the private anonymous pages
+ * of processes which are not running, a batch per timer tick. A page
+ * equal to a merged page is mapped to it read-only and freed. A page
+ * equal to a candidate seen earlier in the same round becomes a merged
+ * page itself, and the candidate is mapped to it. Pages of zeros go to
+ * the zero page. A write to a merged page takes the usual copy-on-write
+ * path, and the last user simply takes the page back. That holds for
+ * kernel writes on behalf of a process as well, CR0.WP is set.
+ *
+ * Both tables are direct mapped by hash and only serve as hints. Every
+ * match is compared byte by byte before anything is merged. The
+ * candidate table is cleared after each round over all processes.
+ */
+
+#define MERGE_SLOTS 1024
+#define MERGE_BATCH 64
+
+struct StableSlot {
+    uint32_t hash;
+    uint64_t pa;
+};
+
+struct CandidateSlot {
+    uint32_t hash;
+    int pid;
+    uint64_t va;
+};
+
+struct MergeScan {
+    struct Process *proc;
+    int budget;
+    /* where the scan ran out of budget */
+    uint64_t next;
+};
+
+static struct StableSlot stable_slots[MERGE_SLOTS];
+static struct CandidateSlot candidate_slots[MERGE_SLOTS];
+static struct MergeInfo merge_info;
+static uint32_t zero_hash;
+static int scan_process;
+static uint64_t scan_va;
+static uint64_t last_scan_tick;
+
+static uint32_t hash_page(const uint64_t *page)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (int i = 0; i < SMALL_PAGE_SIZE / 8; i++) {
+        hash ^= page[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static bool is_scannable(struct Process *proc)
+{
+    return proc != NULL && proc->pid != 0 &&
+           (proc->state == PROC_READY || proc->state == PROC_SLEEP);
+}
+
+/* a page only one map uses, which is neither merged nor the zero page */
+static bool is_mergeable(uint64_t pa)
+{
+    return page_getref(pa) == 1 && page_getflags(pa) == 0;
+}
+
+/* the PTE mapping va if it is present and not behind a shared page table */
+static uint64_t* find_private_entry(uint64_t map, uint64_t va)
+{
+    PD pd = find_pdpt_entry(map, va, 0, 0);
+    uint64_t *entry;
+
+    if (pd == NULL)
+        return NULL;
+
+    entry = &pd[(va >> 21) & 0x1FF];
+    if ((*entry & PTE_P) == 0 || (*entry & (PTE_ENTRY|PTE_SHARED)))
+        return NULL;
+
+    entry = &((PT)P2V(PDE_ADDR(*entry)))[(va >> 12) & 0x1FF];
+    return (*entry & PTE_P) ? entry : NULL;
+}
+
+static bool is_stable(struct StableSlot *slot)
+{
+    return slot->pa != 0 && (page_getflags(slot->pa) & FRAME_MERGED) &&
+           hash_page((uint64_t*)P2V(slot->pa)) == slot->hash;
+}
+
+static uint64_t find_stable_page(uint32_t hash, void *page)
+{
+    struct StableSlot *slot = &stable_slots[hash % MERGE_SLOTS];
+
+    if (slot->pa == 0 || slot->hash != hash || !(page_getflags(slot->pa) & FRAME_MERGED))
+        return 0;
+
+    if (memcmp((void*)P2V(slot->pa), page, SMALL_PAGE_SIZE) != 0)
+        return 0;
+
+    return slot->pa;
+}
+
+/* the entry of the candidate in slot, if it still maps a page equal to page */
+static uint64_t* find_candidate(struct CandidateSlot *slot, uint32_t hash, void *page,
+                                struct Process **owner)
+{
+    if (slot->pid == 0 || slot->hash != hash)
+        return NULL;
+
+    for (int i = 0; i < NUM_PROC; i++) {
+        struct Process *proc = get_process(i);
+
+        if (!is_scannable(proc) || proc->pid != slot->pid)
+            continue;
+
+        uint64_t *entry = find_private_entry(proc->page_map, slot->va);
+        if (entry == NULL || !is_mergeable(PDE_ADDR(*entry)))
+            return NULL;
+        if (memcmp((void*)P2V(PDE_ADDR(*entry)), page, SMALL_PAGE_SIZE) != 0)
+            return NULL;
+
+        *owner = proc;
+        return entry;
+    }
+
+    return NULL;
+}
+
+/* map va to the merged page pa instead, read-only, and free its own page */
+static void replace_page(uint64_t map, uint64_t *entry, uint64_t va, uint64_t pa)
+{
+    uint64_t old = PDE_ADDR(*entry);
+
+    page_incref(pa);
+    *entry = pa | (*entry & PTE_U) | PTE_P;
+    tlb_shootdown(map, va, va + SMALL_PAGE_SIZE);
+    page_decref(old);
+
+    merge_info.merged++;
+}
+
+static void merge_page(struct Process *proc, uint64_t *entry, uint64_t va)
+{
+    uint64_t pa = PDE_ADDR(*entry);
+    void *page = (void*)P2V(pa);
+    uint32_t hash = hash_page(page);
+
+    if (hash == zero_hash && memcmp(page, (void*)P2V(get_zero_page()), SMALL_PAGE_SIZE) == 0) {
+        replace_page(proc->page_map, entry, va, get_zero_page());
+        merge_info.zero_merged++;
+        return;
+    }
+
+    uint64_t stable = find_stable_page(hash, page);
+    if (stable != 0) {
+        replace_page(proc->page_map, entry, va, stable);
+        return;
+    }
+
+    struct CandidateSlot *slot = &candidate_slots[hash % MERGE_SLOTS];
+    struct Process *owner = NULL;
+    uint64_t *other = find_candidate(slot, hash, page, &owner);
+
+    if (other == NULL || other == entry) {
+        slot->hash = hash;
+        slot->pid = proc->pid;
+        slot->va = va;
+        return;
+    }
+
+    /* this page becomes the merged one and the candidate maps it too */
+    *entry &= ~PTE_W;
+    tlb_shootdown(proc->page_map, va, va + SMALL_PAGE_SIZE);
+    page_setflags(pa, FRAME_MERGED);
+
+    struct StableSlot *stable_slot = &stable_slots[hash % MERGE_SLOTS];
+    if (!is_stable(stable_slot)) {
+        stable_slot->hash = hash;
+        stable_slot->pa = pa;
+    }
+
+    replace_page(owner->page_map, other, slot->va, pa);
+    slot->pid = 0;
+}
+
+/* a scan which resumes inside a page table must not enter it once it is shared */
+static uint64_t resume_address(uint64_t map, uint64_t va)
+{
+    PD pd;
+
+    if (va % PAGE_SIZE == 0)
+        return va;
+
+    pd = find_pdpt_entry(map, va, 0, 0);
+    if (pd != NULL && (pd[(va >> 21) & 0x1FF] & PTE_SHARED))
+        return PA_DOWN(va) + PAGE_SIZE;
+
+    return va;
+}
+
+/* the pages behind a shared table are mapped in more than one map */
+static int merge_table(uint64_t *entry, uint64_t va, void *arg)
+{
+    return (*entry & PTE_SHARED) ? WALK_SKIP : WALK_DESCEND;
+}
+
+static bool merge_leaf(uint64_t *entry, uint64_t va, uint64_t size, void *arg)
+{
+    struct MergeScan *scan = arg;
+
+    if (scan->budget == 0) {
+        scan->next = va;
+        return false;
+    }
+
+    if (size != SMALL_PAGE_SIZE || !is_mergeable(PDE_ADDR(*entry)))
+        return true;
+
+    scan->budget--;
+    merge_info.scanned++;
+    merge_page(scan->proc, entry, va);
+
+    return true;
+}
+
+/* scan a batch of pages, at most once per timer tick */
+bool scan_merge_pages(void)
+{
+    uint64_t ticks = get_ticks();
+    int budget = MERGE_BATCH;
+
+    if (ticks == last_scan_tick)
+        return false;
+    last_scan_tick = ticks;
+
+    if (zero_hash == 0)
+        zero_hash = hash_page((uint64_t*)P2V(get_zero_page()));
+
+    for (int i = 0; i <= NUM_PROC && budget > 0; i++) {
+        struct Process *proc = get_process(scan_process);
+
+        if (is_scannable(proc)) {
+            struct MergeScan scan = { proc, budget, MMAP_END };
+            struct PageWalk walk = { proc->page_map, 0, merge_leaf, merge_table, &scan };
+
+            walk_page_tables(&walk, resume_address(proc->page_map, scan_va), MMAP_END);
+            budget = scan.budget;
+
+            if (scan.next < MMAP_END) {
+                scan_va = scan.next;
+                break;
+            }
+        }
+
+        scan_va = 0;
+        scan_process++;
+        if (scan_process == NUM_PROC) {
+            scan_process = 0;
+            memset(candidate_slots, 0, sizeof(candidate_slots));
+        }
+    }
+
+    return true;
+}
+
+/* a write broke up a merged page, its last user takes it back */
+void unmerge_page(uint64_t pa)
+{
+    merge_info.unmerged++;
+
+    if (page_getref(pa) == 1)
+        page_setflags(pa, 0);
+}
+
+void get_merge_info(struct MergeInfo *info)
+{
+    memcpy(info, &merge_info, sizeof(struct MergeInfo));
+
+    for (int i = 0; i < MERGE_SLOTS; i++) {
+        struct StableSlot *slot = &stable_slots[i];
+
+        if (is_stable(slot)) {
+            info->shared++;
+            info->saved += page_getref(slot->pa) - 1;
+        }
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef _KSM_H_
+#define _KSM_H_
+
+#include "stdint.h"
+#include "stdbool.h"
+
+struct MergeInfo {
+    uint64_t scanned;
+    /* pages merged into another one so far, each freed a frame */
+    uint64_t merged;
+    /* of those, pages which became the zero page */
+    uint64_t zero_merged;
+    /* writes which broke up a merged page */
+    uint64_t unmerged;
+    /* merged pages in use now and the frames they save */
+    uint64_t shared;
+    uint64_t saved;
+};
+
+bool scan_merge_pages(void);
+void unmerge_page(uint64_t pa);
+void get_merge_info(struct MergeInfo *info);
+
+#endif
@@ -0,0 +1,75 @@
+#include "kstack.h"
+#include "vmalloc.h"
+#include "memory.h"
+#include "lib.h"
+
+/*
+ * Kernel stacks of processes, 16KB each in the vmalloc region. Nothing
+ * is mapped right below a vmalloc area, so a stack which overflows
+ * faults on that page. The CPU cannot push the page fault onto the
+ * same stack and raises a double fault, which runs on a stack of its
+ * own, see init_cpu_local.
+ *
+ * Stacks start out zeroed, so the deepest word which is not zero shows
+ * how much of a stack was used. A few freed stacks are kept for the next
+ * processes, cleared only as deep as they were used.
+ */
+
+#define KSTACK_CACHE 4
+
+static uint64_t free_stacks[KSTACK_CACHE];
+static int free_count;
+static uint64_t peak_used;
+static struct SpinLock kstack_lock;
+
+uint64_t kernel_stack_used(uint64_t stack)
+{
+    uint64_t *p = (uint64_t*)stack;
+    uint64_t *top = (uint64_t*)(stack + KSTACK_SIZE);
+
+    while (p < top && *p == 0)
+        p++;
+
+    return (uint64_t)top - (uint64_t)p;
+}
+
+uint64_t alloc_kernel_stack(void)
+{
+    uint64_t stack = 0;
+
+    spin_lock(&kstack_lock);
+    if (free_count > 0)
+        stack = free_stacks[--free_count];
+    spin_unlock(&kstack_lock);
+
+    if (stack == 0)
+        stack = (uint64_t)vmalloc(KSTACK_SIZE);
+
+    return stack;
+}
+
+void free_kernel_stack(uint64_t stack)
+{
+    uint64_t used = kernel_stack_used(stack);
+    bool cached = false;
+
+    memset((void*)(stack + KSTACK_SIZE - used), 0, used);
+
+    spin_lock(&kstack_lock);
+    if (used > peak_used)
+        peak_used = used;
+    if (free_count < KSTACK_CACHE) {
+        free_stacks[free_count++] = stack;
+        cached = true;
+    }
+    spin_unlock(&kstack_lock);
+
+    if (!cached)
+        vfree((void*)stack);
+}
+
+/* the deepest any freed stack went, to tune KSTACK_SIZE */
+uint64_t get_kernel_stack_peak(void)
+{
+    return peak_used;
+}
@@ -0,0 +1,13 @@
+#ifndef _KSTACK_H_
+#define _KSTACK_H_
+
+#include "stdint.h"
+
+#define KSTACK_SIZE (16*1024)
+
+uint64_t alloc_kernel_stack(void);
+void free_kernel_stack(uint64_t stack);
+uint64_t kernel_stack_used(uint64_t stack);
+uint64_t get_kernel_stack_peak(void);
+
+#endif
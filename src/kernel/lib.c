@@ -67,3 +67,21 @@ bool is_list_empty(struct HeadList *list)
 {
     return (list->next == NULL);
 }
+
+void spin_lock(struct SpinLock *lock)
+{
+    while (__sync_lock_test_and_set(&lock->locked, 1)) {
+        while (lock->locked)
+            __asm__ volatile("pause");
+    }
+}
+
+bool spin_trylock(struct SpinLock *lock)
+{
+    return __sync_lock_test_and_set(&lock->locked, 1) == 0;
+}
+
+void spin_unlock(struct SpinLock *lock)
+{
+    __sync_lock_release(&lock->locked);
+}
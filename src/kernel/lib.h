@@ -12,7 +12,12 @@ struct HeadList{
 	struct List* tail;
 };
 
+struct SpinLock {
+	volatile int locked;
+};
+
 void memset(void* buffer, char value, int size);
+void memzero_nt(void* buffer, int size);
 void memmove(void* dst, void* src, int size);
 void memcpy(void* dst, void* src, int size);
 int memcmp(void* src1, void* src2, int size);
@@ -20,5 +25,8 @@ void append_list_tail(struct HeadList *list, struct List *item);
 struct List* remove_list_head(struct HeadList *list);
 bool is_list_empty(struct HeadList *list);
 struct List* remove_list(struct HeadList *list, int wait);
+void spin_lock(struct SpinLock *lock);
+bool spin_trylock(struct SpinLock *lock);
+void spin_unlock(struct SpinLock *lock);
 
 #endif
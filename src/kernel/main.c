@@ -4,9 +4,12 @@
 #include "process.h"
 #include "syscall.h"
 #include "cpu.h"
-#include "arch/x86/smp.h"
+#include "smp.h"
 #include "file.h"
+#include "mmap.h"
+#include "vmalloc.h"
 #include "drivers/net/e1000.h"
+#include "net/socket.h"
 
 extern char bss_start;
 extern char bss_end;
@@ -17,13 +20,18 @@ void KMain(void)
    memset(&bss_start, 0, size);
    
    cpu_init();
+   /* held from here until the boot CPU first goes idle */
+   lock_kernel();
    init_idt();
    init_memory();
    init_kheap();
-   init_kvm();
+   init_vmalloc();
    e1000_init();
+   init_socket();
    init_system_call();
    init_fs();
+   init_mmap();
    init_process();
    start_aps();
+   idle();
 }
@@ -5,45 +5,97 @@
 #include "stddef.h"
 #include "trap.h"
 #include "stdbool.h"
+#include "cpu.h"
+#include "file.h"
+#include "acpi.h"
+#include "swap.h"
+#include "kstack.h"
+#include "memtrace.h"
 
 static void free_region(uint64_t v, uint64_t e);
-static uint16_t *page_refs;
+static void free_block(uint64_t pa, int order);
+static void remove_free_block(uint64_t pa, int order);
+static void init_kvm(void);
+static void init_numa(void);
+static bool drain_zero_pools(void);
+static struct PageFrame *page_frames;
 
 static struct FreeMemRegion free_mem_region[50];
-static struct Page free_memory;
+static int free_region_count;
+static struct MemNode mem_nodes[MAX_NODES];
+static int node_count = 1;
+static struct SpinLock memory_lock;
+static struct SpinLock zero_lock;
+static struct SpinLock pt_lock;
+static struct SpinLock pt_share_lock;
+static struct Page *pt_free_list;
+static int pt_free_count;
+static uint64_t memory_start;
 static uint64_t memory_end;
 static uint64_t total_mem;
+static uint64_t ram_end;
+static uint64_t direct_map_end;
+static uint64_t kernel_map;
+static uint64_t cr4_features;
+static uint64_t next_vm_id = 1;
+static bool huge_pages;
+static bool pcid_enabled;
+static uint64_t zero_page;
+static uint64_t zero_page_hits;
 extern char end;
 
-#define PAGE_INDEX(pa) ((pa) / PAGE_SIZE)
+#define PAGE_INDEX(pa) ((pa) / SMALL_PAGE_SIZE)
+#define PAGE_NODE(pa) (&mem_nodes[page_frames[PAGE_INDEX(pa)].node])
+/* PML4 slots below this index map user space, the rest is shared */
+#define USER_PML4_ENTRIES 256
+#define PML4_ENTRY_SIZE (512*HUGE_PAGE_SIZE)
+
+/* physical memory of one node as reported by the SRAT */
+struct NodeRange {
+    uint64_t start;
+    uint64_t end;
+    int node;
+};
+
+#define MAX_NODE_RANGES 16
+
+static struct NodeRange node_ranges[MAX_NODE_RANGES];
+static int node_range_count;
+static uint32_t node_domains[MAX_NODES];
 
 static void set_page_ref(uint64_t pa, uint16_t val)
 {
-    page_refs[PAGE_INDEX(pa)] = val;
+    page_frames[PAGE_INDEX(pa)].ref = val;
 }
 
 static void inc_page_ref(uint64_t pa)
 {
-    page_refs[PAGE_INDEX(pa)]++;
+    page_frames[PAGE_INDEX(pa)].ref++;
 }
 
 static uint16_t get_page_ref(uint64_t pa)
 {
-    return page_refs[PAGE_INDEX(pa)];
+    return page_frames[PAGE_INDEX(pa)].ref;
 }
 
 void page_incref(uint64_t pa)
 {
+    if (page_frames[PAGE_INDEX(pa)].flags & FRAME_RESERVED)
+        return;
     inc_page_ref(pa);
 }
 
 void page_decref(uint64_t pa)
 {
-    uint16_t *ref = &page_refs[PAGE_INDEX(pa)];
-    if (*ref > 0)
-        (*ref)--;
-    if (*ref == 0)
+    struct PageFrame *frame = &page_frames[PAGE_INDEX(pa)];
+    if (frame->flags & FRAME_RESERVED)
+        return;
+    if (frame->ref > 0)
+        frame->ref--;
+    if (frame->ref == 0) {
+        frame->flags &= ~FRAME_MERGED;
         kfree(P2V(pa));
+    }
 }
 
 uint16_t page_getref(uint64_t pa)
@@ -51,41 +103,147 @@ uint16_t page_getref(uint64_t pa)
     return get_page_ref(pa);
 }
 
+uint8_t page_getflags(uint64_t pa)
+{
+    return page_frames[PAGE_INDEX(pa)].flags;
+}
+
+void page_setflags(uint64_t pa, uint8_t flags)
+{
+    page_frames[PAGE_INDEX(pa)].flags = flags;
+}
+
+/*
+ * Hand the usable memory inside the physical range [start, end) to the
+ * buddy allocator. The file system image loaded at FS_BASE stays out.
+ */
+static void free_usable_memory(uint64_t start, uint64_t end)
+{
+    for (int i = 0; i < free_region_count; i++) {
+        uint64_t s = free_mem_region[i].address;
+        uint64_t e = s + free_mem_region[i].length;
+
+        if (s < start)
+            s = start;
+        if (e > end)
+            e = end;
+        if (s >= e)
+            continue;
+
+        if (s < FS_BASE + FS_SIZE && e > FS_BASE) {
+            if (s < FS_BASE)
+                free_region(P2V(s), P2V(FS_BASE));
+            if (e > FS_BASE + FS_SIZE)
+                free_region(P2V(FS_BASE + FS_SIZE), P2V(e));
+        }
+        else {
+            free_region(P2V(s), P2V(e));
+        }
+    }
+}
+
 void init_memory(void)
 {
     int32_t count = *(int32_t*)0x20000;
     struct E820 *mem_map = (struct E820*)0x20008;	
-    int free_region_count = 0;
+    uint32_t regs[4];
 
     ASSERT(count <= 50);
 
 	for(int32_t i = 0; i < count; i++) {        
-        if(mem_map[i].type == 1) {			
+        if(mem_map[i].type == 1 && mem_map[i].address < DIRECT_MAP_LIMIT) {
+            uint64_t length = mem_map[i].length;
+            if (mem_map[i].address + length > DIRECT_MAP_LIMIT)
+                length = DIRECT_MAP_LIMIT - mem_map[i].address;
+
             free_mem_region[free_region_count].address = mem_map[i].address;
-            free_mem_region[free_region_count].length = mem_map[i].length;
-            total_mem += mem_map[i].length;
+            free_mem_region[free_region_count].length = length;
+            total_mem += length;
+            if (mem_map[i].address + length > ram_end)
+                ram_end = mem_map[i].address + length;
             free_region_count++;
         }
         printk("%x  %uKB  %u\n",mem_map[i].address,mem_map[i].length/1024,(uint64_t)mem_map[i].type);
 	}
 
-    for (int i = 0; i < free_region_count; i++) {                  
+    /* map at least the low 4GB so device memory below it is reachable */
+    direct_map_end = HPA_UP(ram_end);
+    if (direct_map_end < 4*HUGE_PAGE_SIZE)
+        direct_map_end = 4*HUGE_PAGE_SIZE;
+
+    cpuid(0x80000000, 0, regs);
+    if (regs[0] >= 0x80000001) {
+        cpuid(0x80000001, 0, regs);
+        huge_pages = (regs[3] & (1 << 26)) != 0;
+    }
+
+    /* the frame table follows the kernel image and has to exist before
+       any page is handed to kfree, so it must fit in the boot mapping */
+    uint64_t table_size = PAGE_INDEX(ram_end) * sizeof(struct PageFrame);
+    page_frames = (struct PageFrame*)PA_UP((uint64_t)&end);
+    memory_start = PA_UP((uint64_t)page_frames + table_size);
+    ASSERT(V2P(memory_start) <= FS_BASE);
+
+    bool usable = false;
+    for (int i = 0; i < free_region_count; i++) {
         uint64_t vstart = P2V(free_mem_region[i].address);
         uint64_t vend = vstart + free_mem_region[i].length;
 
-        if (vstart > (uint64_t)&end) {
-            free_region(vstart, vend);
-        } 
-        else if (vend > (uint64_t)&end) {
-            free_region((uint64_t)&end, vend);
-        }       
+        if (vstart <= (uint64_t)page_frames && memory_start <= vend)
+            usable = true;
     }
-    
-    memory_end = (uint64_t)free_memory.next + PAGE_SIZE;
+    ASSERT(usable);
+    memset(page_frames, 0, table_size);
+
+    for (int n = 0; n < MAX_NODES; n++) {
+        struct MemNode *node = &mem_nodes[n];
+        for (int i = 0; i <= MAX_ORDER; i++) {
+            node->free_area[i].next = &node->free_area[i];
+            node->free_area[i].prev = &node->free_area[i];
+        }
+    }
+
+    /* free pages are linked through their own memory, so only what the
+       boot tables map can be freed before the direct map is built */
+    free_usable_memory(V2P(memory_start), BOOT_MAP_SIZE);
+    init_kvm();
+    /* the ACPI tables usually sit above the boot mapping */
+    init_numa();
+    free_usable_memory(BOOT_MAP_SIZE, ram_end);
+
+    /* pages of the FS image can be mapped into processes */
+    for (uint64_t pa = FS_BASE; pa < FS_BASE + FS_SIZE && pa < ram_end; pa += SMALL_PAGE_SIZE)
+        page_frames[PAGE_INDEX(pa)].flags = FRAME_RESERVED;
+
+    /* read-only stand-in for anonymous memory nobody has written yet */
+    void *page = kalloc_zeroed();
+    ASSERT(page != NULL);
+    zero_page = V2P(page);
+    page_setflags(zero_page, FRAME_RESERVED);
+}
+
+bool map_zero_page(uint64_t map, uint64_t va)
+{
+    if (!map_pages(map, va, va + SMALL_PAGE_SIZE, zero_page, PTE_P|PTE_U))
+        return false;
+
+    __sync_fetch_and_add(&zero_page_hits, 1);
+    return true;
+}
+
+bool is_zero_page(uint64_t pa)
+{
+    return pa == zero_page;
+}
+
+uint64_t get_zero_page(void)
+{
+    return zero_page;
+}
 
-    page_refs = kalloc();
-    if (page_refs)
-        memset(page_refs, 0, PAGE_SIZE);
+uint64_t get_zero_page_hits(void)
+{
+    return zero_page_hits;
 }
 
 uint64_t get_total_memory(void)
@@ -93,293 +251,1755 @@ uint64_t get_total_memory(void)
     return total_mem/1024/1024;
 }
 
-static void free_region(uint64_t v, uint64_t e)
+/*
+ * Nodes are numbered in the order their proximity domains show up in
+ * the SRAT. Without a SRAT all memory and CPUs belong to node 0.
+ */
+static int domain_node(uint32_t domain)
 {
-    for (uint64_t start = PA_UP(v); start+PAGE_SIZE <= e; start += PAGE_SIZE) {        
-        if (start+PAGE_SIZE <= 0xffff800030000000) {            
-           kfree(start);
-        }
+    for (int i = 0; i < node_count; i++) {
+        if (node_domains[i] == domain)
+            return i;
     }
+
+    if (node_count == MAX_NODES)
+        return -1;
+
+    node_domains[node_count] = domain;
+    return node_count++;
 }
 
-void kfree(uint64_t v)
+static void set_cpu_node(uint32_t apic_id, uint32_t domain)
 {
-    ASSERT(v % PAGE_SIZE == 0);
-    ASSERT(v >= (uint64_t) & end);
-    ASSERT(v+PAGE_SIZE <= 0xffff800030000000);
+    int node = domain_node(domain);
 
-    uint64_t pa = V2P(v);
-    set_page_ref(pa, 0);
+    /* CPU n is the one with local APIC id n */
+    if (node >= 0 && apic_id < MAX_CPU)
+        cpus[apic_id].node = node;
+}
 
-    struct Page *page_address = (struct Page*)v;
-    page_address->next = free_memory.next;
-    free_memory.next = page_address;
+static void add_node_range(uint64_t start, uint64_t length, uint32_t domain)
+{
+    int node = domain_node(domain);
+
+    if (node < 0 || node_range_count == MAX_NODE_RANGES || length == 0)
+        return;
+
+    node_ranges[node_range_count].start = start;
+    node_ranges[node_range_count].end = start + length;
+    node_ranges[node_range_count].node = node;
+    node_range_count++;
 }
 
-void* kalloc(void)
+static bool parse_srat(void)
 {
-    struct Page *page_address = free_memory.next;
+    struct Srat *srat = (struct Srat*)acpi_find_table("SRAT");
 
-    if (page_address != NULL) {
-        ASSERT((uint64_t)page_address % PAGE_SIZE == 0);
-        ASSERT((uint64_t)page_address >= (uint64_t)&end);
-        ASSERT((uint64_t)page_address+PAGE_SIZE <= 0xffff800030000000);
+    if (srat == NULL)
+        return false;
 
-        free_memory.next = page_address->next;
-        set_page_ref(V2P(page_address), 1);
+    uint8_t *p = (uint8_t*)(srat + 1);
+    uint8_t *end = (uint8_t*)srat + srat->header.length;
+
+    node_count = 0;
+
+    while (p + sizeof(struct SratEntry) <= end) {
+        struct SratEntry *entry = (struct SratEntry*)p;
+
+        if (entry->length < sizeof(struct SratEntry) || p + entry->length > end)
+            break;
+
+        if (entry->type == SRAT_CPU_AFFINITY) {
+            struct SratCpuAffinity *cpu = (struct SratCpuAffinity*)p;
+            uint32_t domain = cpu->domain_low | (cpu->domain_high[0] << 8) |
+                              (cpu->domain_high[1] << 16) | ((uint32_t)cpu->domain_high[2] << 24);
+            if (cpu->flags & SRAT_ENABLED)
+                set_cpu_node(cpu->apic_id, domain);
+        }
+        else if (entry->type == SRAT_X2APIC_AFFINITY) {
+            struct SratX2apicAffinity *cpu = (struct SratX2apicAffinity*)p;
+            if (cpu->flags & SRAT_ENABLED)
+                set_cpu_node(cpu->x2apic_id, cpu->domain);
+        }
+        else if (entry->type == SRAT_MEMORY_AFFINITY) {
+            struct SratMemoryAffinity *mem = (struct SratMemoryAffinity*)p;
+            if (mem->flags & SRAT_ENABLED)
+                add_node_range(mem->address, mem->length_bytes, mem->domain);
+        }
+
+        p += entry->length;
     }
-    
-    return page_address;
+
+    return node_count > 0 && node_range_count > 0;
 }
 
-static PDPTR find_pml4t_entry(uint64_t map, uint64_t v, int alloc, uint32_t attribute)
+static void parse_slit(void)
 {
-    PDPTR *map_entry = (PDPTR*)map;
-    PDPTR pdptr = NULL;
-    unsigned int index = (v >> 39) & 0x1FF;
+    struct Slit *slit = (struct Slit*)acpi_find_table("SLIT");
 
-    if ((uint64_t)map_entry[index] & PTE_P) {
-        pdptr = (PDPTR)P2V(PDE_ADDR(map_entry[index]));       
-    } 
-    else if (alloc == 1) {
-        pdptr = (PDPTR)kalloc();          
-        if (pdptr != NULL) {     
-            memset(pdptr, 0, PAGE_SIZE);     
-            map_entry[index] = (PDPTR)(V2P(pdptr) | attribute);           
+    for (int i = 0; i < node_count; i++) {
+        for (int j = 0; j < node_count; j++) {
+            uint8_t distance = i == j ? LOCAL_DISTANCE : REMOTE_DISTANCE;
+
+            if (slit != NULL && node_domains[i] < slit->localities &&
+                node_domains[j] < slit->localities) {
+                distance = slit->distance[node_domains[i] * slit->localities + node_domains[j]];
+            }
+            mem_nodes[i].distance[j] = distance;
         }
-    } 
+    }
+}
 
-    return pdptr;    
+/* nearest node first, the node itself always leads */
+static void build_fallback_lists(void)
+{
+    for (int i = 0; i < node_count; i++) {
+        struct MemNode *node = &mem_nodes[i];
+        bool used[MAX_NODES] = { false };
+
+        node->fallback[0] = i;
+        used[i] = true;
+
+        for (int k = 1; k < node_count; k++) {
+            int best = -1;
+
+            for (int j = 0; j < node_count; j++) {
+                if (!used[j] && (best == -1 || node->distance[j] < node->distance[best]))
+                    best = j;
+            }
+
+            used[best] = true;
+            node->fallback[k] = best;
+        }
+    }
 }
 
-PD find_pdpt_entry(uint64_t map, uint64_t v, int alloc, uint32_t attribute)
+/* the end of the run of memory which starts at pa and lies in a single node */
+static uint64_t node_boundary(uint64_t pa, uint64_t end)
 {
-    PDPTR pdptr = NULL;
-    PD pd = NULL;
-    unsigned int index = (v >> 30) & 0x1FF;
+    for (int i = 0; i < node_range_count; i++) {
+        if (node_ranges[i].start > pa && node_ranges[i].start < end)
+            end = node_ranges[i].start;
+        if (node_ranges[i].end > pa && node_ranges[i].end < end)
+            end = node_ranges[i].end;
+    }
 
-    pdptr = find_pml4t_entry(map, v, alloc, attribute);
-    if (pdptr == NULL)
-        return NULL;
-       
-    if ((uint64_t)pdptr[index] & PTE_P) {      
-        pd = (PD)P2V(PDE_ADDR(pdptr[index]));      
+    return end;
+}
+
+static void init_numa(void)
+{
+    struct Page *blocks = NULL;
+
+    if (!parse_srat()) {
+        node_count = 1;
+        node_range_count = 0;
+        mem_nodes[0].distance[0] = LOCAL_DISTANCE;
+        for (int i = 0; i < MAX_CPU; i++)
+            cpus[i].node = 0;
+        return;
     }
-    else if (alloc == 1) {
-        pd = (PD)kalloc();  
-        if (pd != NULL) {    
-            memset(pd, 0, PAGE_SIZE);       
-            pdptr[index] = (PD)(V2P(pd) | attribute);
+
+    parse_slit();
+    build_fallback_lists();
+
+    /* the memory freed so far went to node 0, take it back and free it
+       again once every frame knows its node */
+    for (int order = 0; order <= MAX_ORDER; order++) {
+        while (mem_nodes[0].free_count[order] != 0) {
+            struct Page *page = mem_nodes[0].free_area[order].next;
+            remove_free_block(V2P(page), order);
+            page->next = blocks;
+            blocks = page;
         }
-    } 
+    }
 
-    return pd;
+    for (int i = 0; i < node_range_count; i++) {
+        uint64_t start = node_ranges[i].start;
+        uint64_t stop = node_ranges[i].end < ram_end ? node_ranges[i].end : ram_end;
+
+        for (uint64_t pa = SPA_UP(start); pa < stop; pa += SMALL_PAGE_SIZE)
+            page_frames[PAGE_INDEX(pa)].node = node_ranges[i].node;
+    }
+
+    while (blocks != NULL) {
+        struct Page *page = blocks;
+        uint64_t pa = V2P(page);
+        blocks = page->next;
+        free_region((uint64_t)page, P2V(pa + (SMALL_PAGE_SIZE << page_frames[PAGE_INDEX(pa)].order)));
+    }
+
+    for (int i = 0; i < node_range_count; i++) {
+        struct NodeRange *range = &node_ranges[i];
+        printk("node %u  %x - %x\n", (uint64_t)range->node, range->start, range->end);
+    }
 }
 
-bool map_pages(uint64_t map, uint64_t v, uint64_t e, uint64_t pa, uint32_t attribute)
+/*
+ * Free memory is kept by a buddy allocator. A block of order n is 2^n
+ * contiguous 4KB frames aligned to its own size; the head frame of a free
+ * block is marked FRAME_FREE and records the order. Every node has free
+ * lists of its own and a block never crosses into another node.
+ */
+static void free_region(uint64_t v, uint64_t e)
 {
-    uint64_t vstart = PA_DOWN(v);
-    uint64_t vend = PA_UP(e);
-    PD pd = NULL;
-    unsigned int index;
+    uint64_t start = V2P(SPA_UP(v));
+    uint64_t stop = V2P(SPA_DOWN(e));
 
-    ASSERT(v < e);
-    ASSERT(pa % PAGE_SIZE == 0);
-    ASSERT(pa+vend-vstart <= 1024*1024*1024);
+    if (start >= stop)
+        return;
 
-    do {
-        pd = find_pdpt_entry(map, vstart, 1, attribute);    
-        if (pd == NULL) {
-            return false;
+    if (P2V(stop) > memory_end)
+        memory_end = P2V(stop);
+
+    while (start + SMALL_PAGE_SIZE <= stop) {
+        uint64_t limit = node_boundary(start, stop);
+        int order = MAX_ORDER;
+
+        while (order > 0 && ((start & ((SMALL_PAGE_SIZE << order) - 1)) != 0 ||
+                             start + (SMALL_PAGE_SIZE << order) > limit)) {
+            order--;
         }
 
-        index = (vstart >> 21) & 0x1FF;
-        ASSERT(((uint64_t)pd[index] & PTE_P) == 0);
+        free_block(start, order);
+        start += SMALL_PAGE_SIZE << order;
+    }
+}
 
-        pd[index] = (PDE)(pa | attribute | PTE_ENTRY);
+static void add_free_block(uint64_t pa, int order)
+{
+    struct Page *page = (struct Page*)P2V(pa);
+    struct PageFrame *frame = &page_frames[PAGE_INDEX(pa)];
+    struct MemNode *node = &mem_nodes[frame->node];
+
+    frame->flags |= FRAME_FREE;
+    frame->order = order;
+    frame->ref = 0;
+
+    page->next = node->free_area[order].next;
+    page->prev = &node->free_area[order];
+    node->free_area[order].next->prev = page;
+    node->free_area[order].next = page;
+    node->free_count[order]++;
+}
 
-        vstart += PAGE_SIZE;
-        pa += PAGE_SIZE;
-    } while (vstart + PAGE_SIZE <= vend);
-  
-    return true;
+static void remove_free_block(uint64_t pa, int order)
+{
+    struct Page *page = (struct Page*)P2V(pa);
+
+    page_frames[PAGE_INDEX(pa)].flags &= ~FRAME_FREE;
+    page->prev->next = page->next;
+    page->next->prev = page->prev;
+    PAGE_NODE(pa)->free_count[order]--;
 }
 
-void switch_vm(uint64_t map)
+static void free_block(uint64_t pa, int order)
 {
-    load_cr3(V2P(map));   
+    while (order < MAX_ORDER) {
+        uint64_t buddy = pa ^ (SMALL_PAGE_SIZE << order);
+
+        if (buddy < V2P(memory_start) || buddy + (SMALL_PAGE_SIZE << order) > ram_end)
+            break;
+
+        struct PageFrame *frame = &page_frames[PAGE_INDEX(buddy)];
+        if ((frame->flags & FRAME_FREE) == 0 || frame->order != order ||
+            frame->node != page_frames[PAGE_INDEX(pa)].node)
+            break;
+
+        remove_free_block(buddy, order);
+        if (buddy < pa)
+            pa = buddy;
+        order++;
+    }
+
+    add_free_block(pa, order);
 }
 
-uint64_t setup_kvm(void)
+static uint64_t alloc_node_block(struct MemNode *node, int order)
 {
-    uint64_t page_map = (uint64_t)kalloc();
+    int current = order;
 
-    if (page_map != 0) {
-        memset((void*)page_map, 0, PAGE_SIZE);        
-        if (!map_pages(page_map, KERNEL_BASE, P2V(0x40000000), V2P(KERNEL_BASE), PTE_P|PTE_W)) {
-            free_vm(page_map, PAGE_SIZE);
-            page_map = 0;
+    while (current <= MAX_ORDER && node->free_count[current] == 0)
+        current++;
+
+    if (current > MAX_ORDER)
+        return 0;
+
+    struct Page *page_address = node->free_area[current].next;
+    uint64_t pa = V2P(page_address);
+
+    ASSERT((uint64_t)page_address >= memory_start);
+    ASSERT((uint64_t)page_address+(SMALL_PAGE_SIZE << current) <= memory_end);
+    remove_free_block(pa, current);
+
+    /* hand the upper halves back until the block has the right size */
+    while (current > order) {
+        current--;
+        add_free_block(pa + (SMALL_PAGE_SIZE << current), current);
+    }
+
+    page_frames[PAGE_INDEX(pa)].order = order;
+    page_frames[PAGE_INDEX(pa)].flags = 0;
+
+    return (uint64_t)page_address;
+}
+
+/* take the block from the node of the current CPU, else from the nearest one */
+static uint64_t alloc_block(int order)
+{
+    struct MemNode *local = &mem_nodes[cpu_current()->node];
+
+    for (int i = 0; i < node_count; i++) {
+        uint64_t page = alloc_node_block(&mem_nodes[local->fallback[i]], order);
+
+        if (page != 0) {
+            if (i == 0)
+                local->local_allocs++;
+            else
+                local->remote_allocs++;
+            return page;
         }
     }
-    return page_map;
+
+    return 0;
 }
 
-void init_kvm(void)
+/*
+ * Single pages go through the cache of the current CPU. The shared
+ * free lists are only touched to refill or drain a batch of pages.
+ */
+static void refill_page_cache(struct PageCache *cache)
 {
-    uint64_t page_map = setup_kvm();
-    ASSERT(page_map != 0);
-    switch_vm(page_map);
-    //printk("memory manager is working now");
+    spin_lock(&memory_lock);
+
+    for (int i = 0; i < PAGE_CACHE_BATCH; i++) {
+        struct Page *page = (struct Page*)alloc_block(0);
+        if (page == NULL)
+            break;
+        page->next = cache->pages;
+        cache->pages = page;
+        cache->count++;
+    }
+
+    spin_unlock(&memory_lock);
 }
 
-bool setup_uvm(uint64_t map, uint64_t start, int size)
+static void drain_page_cache(struct PageCache *cache)
 {
-    bool status = false;
-    void *page = kalloc();
+    spin_lock(&memory_lock);
 
-    if (page != NULL) {
-        memset(page, 0, PAGE_SIZE);
-        status = map_pages(map, 0x400000, 0x400000+PAGE_SIZE, V2P(page), PTE_P|PTE_W|PTE_U);
-        if (status == true) {
-            memcpy(page, (void*)start, size);
-        }
-        else {
-            kfree((uint64_t)page);
-            free_vm(map, PAGE_SIZE);
-        }
+    for (int i = 0; i < PAGE_CACHE_BATCH && cache->pages != NULL; i++) {
+        struct Page *page = cache->pages;
+        cache->pages = page->next;
+        cache->count--;
+        free_block(V2P(page), 0);
     }
-    
-    return status;
+
+    spin_unlock(&memory_lock);
 }
 
-void free_pages(uint64_t map, uint64_t vstart, uint64_t vend)
+void kfree(uint64_t v)
 {
-    unsigned int index; 
+    trace_free((void*)v);
 
-    ASSERT(vstart % PAGE_SIZE == 0);
-    ASSERT(vend % PAGE_SIZE == 0);
+    ASSERT(v % SMALL_PAGE_SIZE == 0);
+    ASSERT(v >= memory_start);
+    ASSERT(v+SMALL_PAGE_SIZE <= memory_end);
 
-    do {
-        PD pd = find_pdpt_entry(map, vstart, 0, 0);
+    uint64_t pa = V2P(v);
+    struct PageFrame *frame = &page_frames[PAGE_INDEX(pa)];
 
-        if (pd != NULL) {
-            index = (vstart >> 21) & 0x1FF;
-            if (pd[index] & PTE_P) {        
-                page_decref(PTE_ADDR(pd[index]));
-                pd[index] = 0;
-            }
-        }
+    ASSERT((frame->flags & FRAME_FREE) == 0);
+    ASSERT(v % (SMALL_PAGE_SIZE << frame->order) == 0);
+    frame->ref = 0;
+
+    /* the page cache only holds pages of the local node */
+    if (frame->order == 0 && frame->node == cpu_current()->node) {
+        struct PageCache *cache = &cpu_current()->page_cache;
+        struct Page *page = (struct Page*)v;
+
+        page->next = cache->pages;
+        cache->pages = page;
+        cache->count++;
+
+        if (cache->count > PAGE_CACHE_HIGH)
+            drain_page_cache(cache);
+        return;
+    }
 
-        vstart += PAGE_SIZE;
-    } while (vstart+PAGE_SIZE <= vend);
+    spin_lock(&memory_lock);
+    free_block(pa, frame->order);
+    spin_unlock(&memory_lock);
 }
 
-static void free_pdt(uint64_t map)
+static void* alloc_pages(int order)
 {
-    PDPTR *map_entry = (PDPTR*)map;
+    uint64_t page_address;
 
-    for (int i = 0; i < 512; i++) {
-        if ((uint64_t)map_entry[i] & PTE_P) {            
-            PD *pdptr = (PD*)P2V(PDE_ADDR(map_entry[i]));
-            
-            for (int j = 0; j < 512; j++) {
-                if ((uint64_t)pdptr[j] & PTE_P) {
-                    page_decref(PDE_ADDR(pdptr[j]));
-                    pdptr[j] = 0;
-                }
-            }
-        }
+    ASSERT(order >= 0 && order <= MAX_ORDER);
+
+    if (order == 0)
+        return kalloc();
+
+    spin_lock(&memory_lock);
+    page_address = alloc_block(order);
+    spin_unlock(&memory_lock);
+
+    if (page_address == 0 && drain_zero_pools())
+        return alloc_pages(order);
+
+    /* reclaimed pages land in the page cache, they can only merge into
+       a larger block once they are back on the free lists */
+    if (page_address == 0 && reclaim_pages(RECLAIM_BATCH << order) > 0) {
+        struct PageCache *cache = &cpu_current()->page_cache;
+        while (cache->pages != NULL)
+            drain_page_cache(cache);
+
+        spin_lock(&memory_lock);
+        page_address = alloc_block(order);
+        spin_unlock(&memory_lock);
     }
+
+    if (page_address != 0)
+        set_page_ref(V2P(page_address), 1);
+
+    return (void*)page_address;
 }
 
-static void free_pdpt(uint64_t map)
+void* kalloc_pages(int order)
 {
-    PDPTR *map_entry = (PDPTR*)map;
+    void *page = alloc_pages(order);
 
-    for (int i = 0; i < 512; i++) {
-        if ((uint64_t)map_entry[i] & PTE_P) {
-            page_decref(PDE_ADDR(map_entry[i]));
-            map_entry[i] = 0;
-        }
+    trace_alloc(page, SMALL_PAGE_SIZE << order, __builtin_return_address(0));
+    return page;
+}
+
+static void* alloc_page(void)
+{
+    struct PageCache *cache = &cpu_current()->page_cache;
+
+    if (cache->pages != NULL) {
+        cpu_inc(page_cache.hits);
+    }
+    else {
+        cpu_inc(page_cache.misses);
+        refill_page_cache(cache);
+        if (cache->pages == NULL)
+            return drain_zero_pools() || reclaim_pages(RECLAIM_BATCH) > 0 ? alloc_page() : NULL;
     }
+
+    struct Page *page_address = cache->pages;
+    cache->pages = page_address->next;
+    cache->count--;
+    set_page_ref(V2P(page_address), 1);
+    page_setflags(V2P(page_address), 0);
+
+    return page_address;
 }
 
-static void free_pml4t(uint64_t map)
+void* kalloc(void)
 {
-    page_decref(V2P(map));
+    void *page = alloc_page();
+
+    trace_alloc(page, SMALL_PAGE_SIZE, __builtin_return_address(0));
+    return page;
 }
 
-void free_vm(uint64_t map, uint64_t size)
+/*
+ * Pages which are already zeroed, filled by the idle loop. They stay
+ * allocated while they sit in a pool and are given back when the
+ * allocator runs dry.
+ */
+static struct ZeroPool zero_pools[] = {
+    { NULL, 0, 0, ZERO_POOL_SMALL, 0, 0 },
+    { NULL, PAGE_ORDER, 0, ZERO_POOL_LARGE, 0, 0 },
+};
+
+#define ZERO_POOLS (int)(sizeof(zero_pools) / sizeof(zero_pools[0]))
+
+static struct ZeroPool* find_zero_pool(int order)
 {
-    free_pages(map, 0x400000, 0x400000 + PA_UP(size));
-    free_pdt(map);
-    free_pdpt(map);
-    free_pml4t(map);
+    for (int i = 0; i < ZERO_POOLS; i++) {
+        if (zero_pools[i].order == order)
+            return &zero_pools[i];
+    }
+
+    return NULL;
 }
 
-bool copy_uvm(uint64_t dst_map, uint64_t src_map, int size)
+static bool drain_zero_pools(void)
 {
-    int copied = 0;
-    for (int off = 0; off < size; off += PAGE_SIZE) {
-        void *page = kalloc();
-        if (page == NULL) {
-            free_pages(dst_map, 0x400000, 0x400000 + copied);
-            return false;
-        }
-        memset(page, 0, PAGE_SIZE);
-        if (!map_pages(dst_map, 0x400000 + off, 0x400000 + off + PAGE_SIZE,
-                       V2P(page), PTE_P|PTE_W|PTE_U)) {
+    bool drained = false;
+
+    for (int i = 0; i < ZERO_POOLS; i++) {
+        struct ZeroPool *pool = &zero_pools[i];
+
+        spin_lock(&zero_lock);
+        struct Page *pages = pool->pages;
+        pool->pages = NULL;
+        pool->count = 0;
+        spin_unlock(&zero_lock);
+
+        while (pages != NULL) {
+            struct Page *page = pages;
+            pages = page->next;
             kfree((uint64_t)page);
-            free_pages(dst_map, 0x400000, 0x400000 + copied);
-            return false;
+            drained = true;
         }
+    }
+
+    return drained;
+}
+
+bool refill_zero_pool(void)
+{
+    for (int i = 0; i < ZERO_POOLS; i++) {
+        struct ZeroPool *pool = &zero_pools[i];
+
+        if (pool->count >= pool->target)
+            continue;
 
-        PD pd = find_pdpt_entry(src_map, 0x400000 + off, 0, 0);
-        if (pd == NULL) {
-            free_pages(dst_map, 0x400000, 0x400000 + off + PAGE_SIZE);
+        struct Page *page = pool->order == 0 ? kalloc() : kalloc_pages(pool->order);
+        if (page == NULL)
             return false;
+
+        /* nobody reads these pages soon, so keep them out of the cache */
+        memzero_nt(page, SMALL_PAGE_SIZE << pool->order);
+
+        spin_lock(&zero_lock);
+        page->next = pool->pages;
+        pool->pages = page;
+        pool->count++;
+        spin_unlock(&zero_lock);
+
+        return true;
+    }
+
+    return false;
+}
+
+static void* alloc_pages_zeroed(int order)
+{
+    struct ZeroPool *pool = find_zero_pool(order);
+    struct Page *page = NULL;
+
+    if (pool != NULL) {
+        spin_lock(&zero_lock);
+        page = pool->pages;
+        if (page != NULL) {
+            pool->pages = page->next;
+            pool->count--;
+            pool->hits++;
+        }
+        else {
+            pool->misses++;
         }
+        spin_unlock(&zero_lock);
 
-        unsigned int index = ((0x400000 + off) >> 21) & 0x1FF;
-        ASSERT((uint64_t)pd[index] & PTE_P);
-        uint64_t start = P2V(PTE_ADDR(pd[index]));
-        int to_copy = size - off;
-        if (to_copy > PAGE_SIZE)
-            to_copy = PAGE_SIZE;
-        memcpy(page, (void*)start, to_copy);
-        copied += PAGE_SIZE;
+        if (page != NULL) {
+            page->next = NULL;
+            return page;
+        }
     }
 
-    return true;
+    page = order == 0 ? kalloc() : kalloc_pages(order);
+    if (page != NULL)
+        memset(page, 0, SMALL_PAGE_SIZE << order);
+
+    return page;
 }
 
-bool share_uvm(uint64_t dst_map, uint64_t src_map, int size)
+void* kalloc_pages_zeroed(int order)
 {
-    for (int off = 0; off < size; off += PAGE_SIZE) {
-        PD pd = find_pdpt_entry(src_map, 0x400000 + off, 0, 0);
-        if (pd == NULL)
-            return false;
+    void *page = alloc_pages_zeroed(order);
 
-        unsigned int idx = ((0x400000 + off) >> 21) & 0x1FF;
-        if (!(pd[idx] & PTE_P))
-            continue;
+    trace_alloc(page, SMALL_PAGE_SIZE << order, __builtin_return_address(0));
+    return page;
+}
 
-        uint64_t pa = PTE_ADDR(pd[idx]);
-        pd[idx] &= ~PTE_W;
+void* kalloc_zeroed(void)
+{
+    void *page = alloc_pages_zeroed(0);
 
-        PD dstpd = find_pdpt_entry(dst_map, 0x400000 + off, 1, PTE_P|PTE_U);
-        if (!dstpd)
-            return false;
-        dstpd[idx] = (PDE)(pa | PTE_P | PTE_U | PTE_ENTRY);
+    trace_alloc(page, SMALL_PAGE_SIZE, __builtin_return_address(0));
+    return page;
+}
+
+/*
+ * Page table pages are split off 64KB chunks, so the tables of a map
+ * tend to sit next to each other. Once split each table is a plain
+ * 4KB page: freed tables are kept for reuse up to a limit and the rest
+ * go back to the page allocator. The PML4 frame of a map counts the
+ * table pages of that map.
+ */
+static void refill_pt_list(void)
+{
+    uint8_t *chunk = kalloc_pages(PT_CHUNK_ORDER);
+    int count = 1 << PT_CHUNK_ORDER;
 
-        page_incref(pa);
+    if (chunk == NULL) {
+        chunk = kalloc();
+        count = 1;
     }
 
-    return true;
+    if (chunk == NULL)
+        return;
+
+    /* the tables are freed one by one, the map counts them instead */
+    trace_free(chunk);
+
+    spin_lock(&pt_lock);
+
+    for (int i = 0; i < count; i++) {
+        struct Page *page = (struct Page*)(chunk + i * SMALL_PAGE_SIZE);
+        struct PageFrame *frame = &page_frames[PAGE_INDEX(V2P(page))];
+
+        frame->order = 0;
+        frame->flags = 0;
+        frame->ref = 1;
+
+        page->next = pt_free_list;
+        pt_free_list = page;
+        pt_free_count++;
+    }
+
+    spin_unlock(&pt_lock);
 }
 
-void invalidate_tlb(void)
+static void* pt_alloc(uint64_t map)
 {
-    load_cr3(read_cr3());
-}
+    struct Page *table;
 
+    spin_lock(&pt_lock);
+    if (pt_free_list == NULL) {
+        spin_unlock(&pt_lock);
+        refill_pt_list();
+        spin_lock(&pt_lock);
+    }
+
+    table = pt_free_list;
+    if (table != NULL) {
+        pt_free_list = table->next;
+        pt_free_count--;
+    }
+    spin_unlock(&pt_lock);
+
+    if (table == NULL)
+        return NULL;
+
+    memset(table, 0, SMALL_PAGE_SIZE);
+    if (map != 0)
+        VM_CONTEXT(map)->table_pages++;
+
+    return table;
+}
+
+static void pt_free(uint64_t map, uint64_t table)
+{
+    if (map != 0)
+        VM_CONTEXT(map)->table_pages--;
+
+    spin_lock(&pt_lock);
+    if (pt_free_count < PT_FREE_HIGH) {
+        struct Page *page = (struct Page*)table;
+        page->next = pt_free_list;
+        pt_free_list = page;
+        pt_free_count++;
+        table = 0;
+    }
+    spin_unlock(&pt_lock);
+
+    if (table != 0)
+        kfree(table);
+}
+
+/* a map is its PML4 followed by the page holding its VmContext */
+static uint64_t alloc_page_map(void)
+{
+    uint64_t map = (uint64_t)kalloc_pages_zeroed(VM_MAP_ORDER);
+
+    if (map != 0) {
+        VM_CONTEXT(map)->id = __sync_fetch_and_add(&next_vm_id, 1);
+        VM_CONTEXT(map)->table_pages = 1;
+    }
+
+    return map;
+}
+
+uint64_t get_page_table_pages(uint64_t map)
+{
+    return VM_CONTEXT(map)->table_pages;
+}
+
+uint64_t get_free_blocks(int order)
+{
+    uint64_t count = 0;
+
+    if (order < 0 || order > MAX_ORDER)
+        return 0;
+
+    for (int i = 0; i < node_count; i++)
+        count += mem_nodes[i].free_count[order];
+
+    return count;
+}
+
+uint64_t get_free_pages(void)
+{
+    uint64_t count = 0;
+
+    for (int order = 0; order <= MAX_ORDER; order++)
+        count += get_free_blocks(order) << order;
+
+    return count;
+}
+
+void get_mem_stats(struct MemStats *stats)
+{
+    struct SwapInfo swap;
+
+    memset(stats, 0, sizeof(struct MemStats));
+    stats->total_pages = total_mem / SMALL_PAGE_SIZE;
+    stats->free_pages = get_free_pages();
+
+    for (int i = 0; i < cpu_count; i++)
+        stats->cached_pages += cpus[i].page_cache.count;
+    for (int i = 0; i < ZERO_POOLS; i++)
+        stats->cached_pages += (uint64_t)zero_pools[i].count << zero_pools[i].order;
+
+    if (stats->total_pages > stats->free_pages + stats->cached_pages)
+        stats->used_pages = stats->total_pages - stats->free_pages - stats->cached_pages;
+
+    get_swap_info(&swap);
+    stats->store_pages = swap.store_pages;
+    stats->stored_pages = swap.stored_pages;
+    stats->stack_peak = get_kernel_stack_peak();
+}
+
+/*
+ * Free blocks of each node by order, and how much of the free memory
+ * sits in blocks too small for the orders the kernel asks for.
+ */
+void print_page_fragmentation(void)
+{
+    static const int orders[] = { VM_MAP_ORDER, PT_CHUNK_ORDER, PAGE_ORDER };
+
+    for (int i = 0; i < node_count; i++) {
+        struct MemNode *node = &mem_nodes[i];
+        uint64_t free = 0;
+        int largest = -1;
+
+        for (int order = 0; order <= MAX_ORDER; order++) {
+            free += node->free_count[order] << order;
+            if (node->free_count[order] != 0)
+                largest = order;
+        }
+
+        printk("node %d: %u free pages, largest order %d\n", i, free, largest);
+
+        printk("   blocks:");
+        for (int order = 0; order <= largest; order++) {
+            if (node->free_count[order] != 0)
+                printk(" %d:%u", order, node->free_count[order]);
+        }
+
+        printk("\n   unusable:");
+        for (int j = 0; j < (int)(sizeof(orders) / sizeof(orders[0])); j++) {
+            uint64_t smaller = 0;
+
+            for (int order = 0; order < orders[j]; order++)
+                smaller += node->free_count[order] << order;
+            printk(" %d:%u", orders[j], free != 0 ? smaller * 100 / free : 0);
+        }
+        printk(" (percent)\n");
+    }
+}
+
+int get_node_count(void)
+{
+    return node_count;
+}
+
+int page_node(uint64_t pa)
+{
+    return page_frames[PAGE_INDEX(pa)].node;
+}
+
+static PDPTR find_pml4t_entry(uint64_t map, uint64_t v, int alloc, uint32_t attribute)
+{
+    PDPTR *map_entry = (PDPTR*)map;
+    PDPTR pdptr = NULL;
+    unsigned int index = (v >> 39) & 0x1FF;
+
+    if ((uint64_t)map_entry[index] & PTE_P) {
+        pdptr = (PDPTR)P2V(PDE_ADDR(map_entry[index]));       
+    } 
+    else if (alloc == 1) {
+        pdptr = (PDPTR)pt_alloc(map);
+        if (pdptr != NULL) {     
+            map_entry[index] = (PDPTR)(V2P(pdptr) | attribute);           
+        }
+    } 
+
+    return pdptr;    
+}
+
+PD find_pdpt_entry(uint64_t map, uint64_t v, int alloc, uint32_t attribute)
+{
+    PDPTR pdptr = NULL;
+    PD pd = NULL;
+    unsigned int index = (v >> 30) & 0x1FF;
+
+    pdptr = find_pml4t_entry(map, v, alloc, attribute);
+    if (pdptr == NULL)
+        return NULL;
+       
+    if ((uint64_t)pdptr[index] & PTE_P) {
+        /* a 1GB mapping has no page directory below it */
+        if ((uint64_t)pdptr[index] & PTE_ENTRY)
+            return NULL;
+        pd = (PD)P2V(PDE_ADDR(pdptr[index]));      
+    }
+    else if (alloc == 1) {
+        pd = (PD)pt_alloc(map);
+        if (pd != NULL) {    
+            pdptr[index] = (PD)(V2P(pd) | attribute);
+        }
+    } 
+
+    return pd;
+}
+
+PT find_pdt_entry(uint64_t map, uint64_t v, int alloc, uint32_t attribute)
+{
+    PD pd = NULL;
+    PT pt = NULL;
+    unsigned int index = (v >> 21) & 0x1FF;
+
+    pd = find_pdpt_entry(map, v, alloc, attribute);
+    if (pd == NULL)
+        return NULL;
+
+    if (pd[index] & PTE_P) {
+        /* a 2MB mapping has no page table below it */
+        if (pd[index] & PTE_ENTRY)
+            return NULL;
+        pt = (PT)P2V(PDE_ADDR(pd[index]));
+    }
+    else if (alloc == 1) {
+        pt = (PT)pt_alloc(map);
+        if (pt != NULL) {
+            pd[index] = (PDE)(V2P(pt) | attribute);
+        }
+    }
+
+    return pt;
+}
+
+uint64_t* find_page_entry(uint64_t map, uint64_t v, uint64_t *size)
+{
+    PD pd = find_pdpt_entry(map, v, 0, 0);
+    unsigned int index = (v >> 21) & 0x1FF;
+
+    if (pd == NULL || (pd[index] & PTE_P) == 0)
+        return NULL;
+
+    if (pd[index] & PTE_ENTRY) {
+        *size = PAGE_SIZE;
+        return &pd[index];
+    }
+
+    PT pt = (PT)P2V(PDE_ADDR(pd[index]));
+    index = (v >> 12) & 0x1FF;
+
+    if ((pt[index] & PTE_P) == 0)
+        return NULL;
+
+    *size = SMALL_PAGE_SIZE;
+    return &pt[index];
+}
+
+/*
+ * fork lets the child use the parent's page tables. A page table used
+ * by more than one map is marked PTE_SHARED in the PDEs pointing to it,
+ * which are read-only, and its frame counts those PDEs. The first write
+ * through it gives the writer a copy, whose pages are then shared
+ * copy-on-write like after a normal fork. The last map left using it
+ * simply takes it over.
+ */
+static uint64_t* unshare_page_table(uint64_t map, uint64_t *entry, uint64_t va)
+{
+    uint64_t *old = (uint64_t*)P2V(PDE_ADDR(*entry));
+    uint64_t attribute = (*entry & (PTE_P|PTE_U)) | PTE_W;
+    uint64_t *table = old;
+
+    spin_lock(&pt_share_lock);
+    if (page_getref(V2P(old)) > 1) {
+        table = pt_alloc(map);
+        if (table == NULL) {
+            spin_unlock(&pt_share_lock);
+            return NULL;
+        }
+
+        for (int i = 0; i < 512; i++) {
+            if (old[i] & PTE_P) {
+                old[i] &= ~PTE_W;
+                page_incref(PDE_ADDR(old[i]));
+            }
+            else if (old[i] & PTE_SWAP) {
+                swap_dup(old[i]);
+            }
+            table[i] = old[i];
+        }
+
+        page_decref(V2P(old));
+        VM_CONTEXT(map)->table_pages--;
+    }
+    *entry = V2P(table) | attribute;
+    spin_unlock(&pt_share_lock);
+
+    /* walks may still go through the old table */
+    if (table != old)
+        tlb_shootdown(map, PA_DOWN(va), PA_DOWN(va) + PAGE_SIZE);
+
+    return table;
+}
+
+/* stop using a shared page table, false if map was its last user and now owns it */
+static bool drop_shared_table(uint64_t map, uint64_t *entry)
+{
+    uint64_t pa = PDE_ADDR(*entry);
+    bool dropped;
+
+    spin_lock(&pt_share_lock);
+    dropped = page_getref(pa) > 1;
+    if (dropped) {
+        page_decref(pa);
+        VM_CONTEXT(map)->table_pages--;
+        *entry = 0;
+    }
+    else {
+        *entry = pa | (*entry & (PTE_P|PTE_U)) | PTE_W;
+    }
+    spin_unlock(&pt_share_lock);
+
+    return dropped;
+}
+
+/* the writer of va gets a page table of its own */
+bool unshare_page_tables(uint64_t map, uint64_t va)
+{
+    PD pd = find_pdpt_entry(map, va, 0, 0);
+    uint64_t *entry;
+
+    if (pd == NULL)
+        return true;
+
+    entry = &pd[(va >> 21) & 0x1FF];
+    if ((*entry & PTE_P) && (*entry & PTE_SHARED))
+        return unshare_page_table(map, entry, va) != NULL;
+
+    return true;
+}
+
+/* the table below entry, created if there is none */
+static uint64_t* get_next_table(uint64_t map, uint64_t *entry, uint32_t attribute)
+{
+    uint64_t *table;
+
+    if (*entry & PTE_P) {
+        ASSERT((*entry & (PTE_ENTRY|PTE_SHARED)) == 0);
+        return (uint64_t*)P2V(PDE_ADDR(*entry));
+    }
+
+    table = pt_alloc(map);
+    if (table != NULL)
+        *entry = V2P(table) | attribute;
+
+    return table;
+}
+
+static uint64_t* get_page_table(uint64_t map, uint64_t *pde, uint64_t va, uint32_t attribute)
+{
+    if ((*pde & PTE_P) && (*pde & PTE_SHARED))
+        return unshare_page_table(map, pde, va);
+
+    return get_next_table(map, pde, attribute);
+}
+
+/* 
+ * Map [v, e) to physical memory starting at pa. Each step uses the
+ * largest entry (1GB if the CPU has them, 2MB, 4KB) for which both
+ * addresses are aligned and a whole page still fits in the range.
+ * Every table on the way is looked up once and then filled in order.
+ */
+bool map_pages(uint64_t map, uint64_t v, uint64_t e, uint64_t pa, uint32_t attribute)
+{
+    uint64_t vstart = SPA_DOWN(v);
+    uint64_t vend = SPA_UP(e);
+    uint32_t table_attribute = PTE_P | PTE_W | (attribute & PTE_U);
+
+    ASSERT(v < e);
+    ASSERT(pa % SMALL_PAGE_SIZE == 0);
+
+    do {
+        uint64_t *pdpt = get_next_table(map, &((uint64_t*)map)[(vstart >> 39) & 0x1FF],
+                                        table_attribute);
+        if (pdpt == NULL)
+            return false;
+
+        do {
+            uint64_t *pdpte = &pdpt[(vstart >> 30) & 0x1FF];
+
+            if (huge_pages && vstart % HUGE_PAGE_SIZE == 0 && pa % HUGE_PAGE_SIZE == 0 &&
+                vstart + HUGE_PAGE_SIZE <= vend && (*pdpte & PTE_P) == 0) {
+                *pdpte = pa | attribute | PTE_ENTRY;
+                vstart += HUGE_PAGE_SIZE;
+                pa += HUGE_PAGE_SIZE;
+                continue;
+            }
+
+            uint64_t *pd = get_next_table(map, pdpte, table_attribute);
+            if (pd == NULL)
+                return false;
+
+            do {
+                uint64_t *pde = &pd[(vstart >> 21) & 0x1FF];
+
+                if (vstart % PAGE_SIZE == 0 && pa % PAGE_SIZE == 0 &&
+                    vstart + PAGE_SIZE <= vend && (*pde & PTE_P) == 0) {
+                    *pde = pa | attribute | PTE_ENTRY;
+                    vstart += PAGE_SIZE;
+                    pa += PAGE_SIZE;
+                    continue;
+                }
+
+                uint64_t *pt = get_page_table(map, pde, vstart, table_attribute);
+                if (pt == NULL)
+                    return false;
+
+                do {
+                    uint64_t *pte = &pt[(vstart >> 12) & 0x1FF];
+
+                    ASSERT((*pte & (PTE_P|PTE_SWAP)) == 0);
+                    *pte = pa | attribute;
+                    vstart += SMALL_PAGE_SIZE;
+                    pa += SMALL_PAGE_SIZE;
+                } while (vstart < vend && vstart % PAGE_SIZE != 0);
+            } while (vstart < vend && vstart % HUGE_PAGE_SIZE != 0);
+        } while (vstart < vend && vstart % PML4_ENTRY_SIZE != 0);
+    } while (vstart < vend);
+  
+    return true;
+}
+
+/*
+ * Call visit for every present leaf entry of [start, end), with the
+ * base address and size of the page it maps. Tables which are not
+ * present are skipped as a whole, so the cost follows the number of
+ * mapped pages rather than the size of the range. With WALK_SWAP the
+ * entries of pages in the compressed store are visited as well.
+ */
+static bool walk_table(struct PageWalk *walk, uint64_t *table, int shift, uint64_t va, uint64_t end)
+{
+    uint64_t size = 1ULL << shift;
+
+    while (va < end) {
+        uint64_t *entry = &table[(va >> shift) & 0x1FF];
+        uint64_t base = va & ~(size - 1);
+        uint64_t next = base + size;
+
+        /* the last slot of the address space wraps around */
+        if (next < va || next > end)
+            next = end;
+
+        if (*entry & PTE_P) {
+            if (shift == 12 || (shift < 39 && (*entry & PTE_ENTRY))) {
+                if (!walk->visit(entry, base, size, walk->arg))
+                    return false;
+            }
+            else {
+                int action = WALK_DESCEND;
+
+                if (shift == 21 && walk->visit_table != NULL && va == base && next == base + size)
+                    action = walk->visit_table(entry, base, walk->arg);
+                if (action == WALK_ABORT)
+                    return false;
+
+                if (action == WALK_DESCEND) {
+                    if ((*entry & PTE_SHARED) && (walk->flags & WALK_PRIVATE) &&
+                        unshare_page_table(walk->map, entry, base) == NULL)
+                        return false;
+                    if (!walk_table(walk, (uint64_t*)P2V(PDE_ADDR(*entry)), shift - 9, va, next))
+                        return false;
+                }
+            }
+        }
+        else if (shift == 12 && (*entry & PTE_SWAP) && (walk->flags & WALK_SWAP)) {
+            if (!walk->visit(entry, base, size, walk->arg))
+                return false;
+        }
+
+        va = next;
+    }
+
+    return true;
+}
+
+bool walk_page_tables(struct PageWalk *walk, uint64_t start, uint64_t end)
+{
+    return walk_table(walk, (uint64_t*)walk->map, 39, start, end);
+}
+
+bool walk_page_range(uint64_t map, uint64_t start, uint64_t end, PageVisitor visit, void *arg)
+{
+    struct PageWalk walk = { map, WALK_PRIVATE, visit, NULL, arg };
+
+    return walk_page_tables(&walk, start, end);
+}
+
+/*
+ * With PCIDs every CPU keeps the TLB entries of its last ASID_SLOTS
+ * maps. A map which comes back to its slot is loaded without a flush
+ * unless its tlb_gen moved on since the slot last saw it. A map which
+ * takes over a slot flushes the entries of the previous owner.
+ */
+void switch_vm(uint64_t map)
+{
+    struct VmContext *context = VM_CONTEXT(map);
+    struct TlbState *tlb = &cpu_current()->tlb;
+    uint64_t tlb_gen;
+    bool flush = false;
+    int slot;
+
+    /* publish the new map before reading its generation, a shootdown
+       bumps the generation before looking at active_map */
+    tlb->active_map = map;
+    __sync_synchronize();
+    tlb_gen = context->tlb_gen;
+
+    if (!pcid_enabled) {
+        tlb->current_slot = -1;
+        load_cr3(V2P(map));
+        return;
+    }
+
+    for (slot = 0; slot < ASID_SLOTS; slot++) {
+        if (tlb->slots[slot].id == context->id)
+            break;
+    }
+
+    if (slot == ASID_SLOTS) {
+        slot = tlb->next_slot;
+        tlb->next_slot = (slot + 1) % ASID_SLOTS;
+        tlb->slots[slot].id = context->id;
+        flush = true;
+    }
+    else if (tlb->slots[slot].tlb_gen != tlb_gen) {
+        flush = true;
+    }
+
+    tlb->slots[slot].tlb_gen = tlb_gen;
+    tlb->current_slot = slot;
+    load_cr3(V2P(map) | (slot + 1) | (flush ? 0 : CR3_NOFLUSH));
+}
+
+/*
+ * Called after entries of map were changed. The new generation makes
+ * every CPU which only has map cached in a slot flush it when it loads
+ * map again, so only CPUs running map right now need flush_tlb_local.
+ */
+uint64_t flush_tlb_begin(uint64_t map)
+{
+    uint64_t tlb_gen = __sync_add_and_fetch(&VM_CONTEXT(map)->tlb_gen, 1);
+
+    __sync_synchronize();
+    return tlb_gen;
+}
+
+/*
+ * Kernel mappings are global and cached regardless of the PCID. invlpg
+ * drops a global entry, toggling CR4.PGE drops all of them.
+ */
+static void flush_tlb_kernel(uint64_t start, uint64_t end)
+{
+    uint64_t cr4 = read_cr4();
+
+    if ((end - start) / SMALL_PAGE_SIZE <= TLB_FLUSH_PAGES) {
+        for (uint64_t v = SPA_DOWN(start); v < end; v += SMALL_PAGE_SIZE)
+            invlpg(v);
+        cpu_inc(tlb.invlpgs);
+    }
+    else if (cr4 & CR4_PGE) {
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+        cpu_inc(tlb.flushes);
+    }
+    else {
+        load_cr3(read_cr3());
+        cpu_inc(tlb.flushes);
+    }
+}
+
+void flush_tlb_local(uint64_t map, uint64_t start, uint64_t end, uint64_t tlb_gen)
+{
+    struct TlbState *tlb = &cpu_current()->tlb;
+    struct AsidSlot *slot = NULL;
+
+    if (start >= KERNEL_BASE) {
+        flush_tlb_kernel(start, end);
+        return;
+    }
+
+    if (tlb->active_map != map)
+        return;
+
+    if (tlb->current_slot >= 0)
+        slot = &tlb->slots[tlb->current_slot];
+
+    if ((end - start) / SMALL_PAGE_SIZE <= TLB_FLUSH_PAGES) {
+        for (uint64_t v = SPA_DOWN(start); v < end; v += SMALL_PAGE_SIZE)
+            invlpg(v);
+        cpu_inc(tlb.invlpgs);
+
+        /* the slot is only current if it missed nothing but this change */
+        if (slot != NULL && slot->tlb_gen == tlb_gen - 1)
+            slot->tlb_gen = tlb_gen;
+    }
+    else {
+        uint64_t cr3 = V2P(map);
+
+        if (slot != NULL) {
+            slot->tlb_gen = VM_CONTEXT(map)->tlb_gen;
+            cr3 |= tlb->current_slot + 1;
+        }
+        load_cr3(cr3);
+        cpu_inc(tlb.flushes);
+    }
+}
+
+/*
+ * Every address space points at the same kernel PDPTs, so a new map
+ * only needs its own PML4 and kernel mappings show up everywhere.
+ */
+uint64_t setup_kvm(void)
+{
+    uint64_t page_map = alloc_page_map();
+
+    if (page_map != 0) {
+        memcpy((PDPTR*)page_map + USER_PML4_ENTRIES, (PDPTR*)kernel_map + USER_PML4_ENTRIES,
+               (512 - USER_PML4_ENTRIES) * sizeof(PDPTR));
+    }
+    return page_map;
+}
+
+uint64_t get_kernel_map(void)
+{
+    return kernel_map;
+}
+
+static void init_kvm(void)
+{
+    kernel_map = alloc_page_map();
+    ASSERT(kernel_map != 0);
+    ASSERT(map_pages(kernel_map, KERNEL_BASE, P2V(direct_map_end), 0, PTE_P|PTE_W|PTE_G));
+    /* created now so that maps copied from kernel_map share it */
+    ASSERT(find_pml4t_entry(kernel_map, VMALLOC_BASE, 1, PTE_P|PTE_W) != NULL);
+    switch_vm(kernel_map);
+
+    /* the direct map is global, so it survives address space switches */
+    uint32_t regs[4];
+
+    cpuid(1, 0, regs);
+    if ((regs[3] & (1 << 13)) || (read_cr4() & CR4_PGE))
+        cr4_features |= CR4_PGE;
+    /* kernel flushes rely on global pages to reach every PCID */
+    if ((regs[2] & (1 << 17)) && (cr4_features & CR4_PGE)) {
+        cr4_features |= CR4_PCIDE;
+        pcid_enabled = true;
+    }
+    write_cr4(read_cr4() | cr4_features);
+}
+
+/*
+ * An AP comes up on the trampoline tables. PCIDs can only be turned on
+ * while CR3 has none, so the features go on before the switch.
+ */
+void init_cpu_paging(void)
+{
+    write_cr4(read_cr4() | cr4_features);
+    switch_vm(kernel_map);
+}
+
+bool setup_uvm(uint64_t map, uint64_t start, int size)
+{
+    bool status = false;
+    void *page = kalloc_pages_zeroed(PAGE_ORDER);
+
+    if (page != NULL) {
+        status = map_pages(map, 0x400000, 0x400000+PAGE_SIZE, V2P(page), PTE_P|PTE_W|PTE_U);
+        if (status == true) {
+            memcpy(page, (void*)start, size);
+        }
+        else {
+            kfree((uint64_t)page);
+            free_vm(map, PAGE_SIZE);
+        }
+    }
+    
+    return status;
+}
+
+/* the range a batch of leaf changes has to flush */
+struct FlushRange {
+    uint64_t start;
+    uint64_t end;
+};
+
+static void add_flush_range(struct FlushRange *flush, uint64_t va, uint64_t size)
+{
+    if (flush->start == flush->end)
+        flush->start = va;
+    flush->end = va + size;
+}
+
+/*
+ * Populate [vstart, vend) with zeroed anonymous memory in one pass
+ * over the tables. Whole aligned 2MB blocks get a large page, the rest
+ * is backed by 4KB pages. Pages that are already mapped are kept,
+ * except that a writable request replaces the zero page. Pages in the
+ * compressed store are brought back.
+ */
+static bool populate_pages(uint64_t map, uint64_t vstart, uint64_t vend, uint32_t attribute,
+                           struct FlushRange *flush)
+{
+    uint32_t table_attribute = PTE_P | PTE_W | (attribute & PTE_U);
+
+    while (vstart < vend) {
+        uint64_t *pdpt = get_next_table(map, &((uint64_t*)map)[(vstart >> 39) & 0x1FF],
+                                        table_attribute);
+        if (pdpt == NULL)
+            return false;
+
+        do {
+            uint64_t *pdpte = &pdpt[(vstart >> 30) & 0x1FF];
+
+            if ((*pdpte & PTE_P) && (*pdpte & PTE_ENTRY)) {
+                vstart = (vstart & ~(HUGE_PAGE_SIZE - 1)) + HUGE_PAGE_SIZE;
+                continue;
+            }
+
+            uint64_t *pd = get_next_table(map, pdpte, table_attribute);
+            if (pd == NULL)
+                return false;
+
+            do {
+                uint64_t *pde = &pd[(vstart >> 21) & 0x1FF];
+
+                if ((*pde & PTE_P) && (*pde & PTE_ENTRY)) {
+                    vstart = PA_DOWN(vstart) + PAGE_SIZE;
+                    continue;
+                }
+
+                if ((*pde & PTE_P) == 0 && vstart % PAGE_SIZE == 0 && vstart + PAGE_SIZE <= vend) {
+                    void *page = kalloc_pages_zeroed(PAGE_ORDER);
+                    if (page != NULL) {
+                        *pde = V2P(page) | attribute | PTE_ENTRY;
+                        vstart += PAGE_SIZE;
+                        continue;
+                    }
+                }
+
+                uint64_t *pt = get_page_table(map, pde, vstart, table_attribute);
+                if (pt == NULL)
+                    return false;
+
+                do {
+                    uint64_t *pte = &pt[(vstart >> 12) & 0x1FF];
+
+                    if ((*pte & PTE_SWAP) && !swap_in_entry(pte))
+                        return false;
+
+                    bool zero = (*pte & PTE_P) && is_zero_page(PDE_ADDR(*pte));
+
+                    if ((*pte & PTE_P) == 0 || (zero && (attribute & PTE_W))) {
+                        void *page = kalloc_zeroed();
+                        if (page == NULL)
+                            return false;
+                        if (zero)
+                            add_flush_range(flush, vstart, SMALL_PAGE_SIZE);
+                        *pte = V2P(page) | attribute;
+                    }
+                    vstart += SMALL_PAGE_SIZE;
+                } while (vstart < vend && vstart % PAGE_SIZE != 0);
+            } while (vstart < vend && vstart % HUGE_PAGE_SIZE != 0);
+        } while (vstart < vend && vstart % PML4_ENTRY_SIZE != 0);
+    }
+
+    return true;
+}
+
+bool alloc_uvm(uint64_t map, uint64_t v, uint64_t e, uint32_t attribute)
+{
+    struct FlushRange flush = { 0, 0 };
+    bool status = populate_pages(map, SPA_DOWN(v), SPA_UP(e), attribute, &flush);
+
+    /* replaced zero pages may still be cached read-only */
+    if (flush.start != flush.end)
+        tlb_shootdown(map, flush.start, flush.end);
+
+    return status;
+}
+
+struct FreeRange {
+    uint64_t map;
+    uint64_t start;
+    uint64_t end;
+    struct FlushRange flush;
+    bool kept;
+};
+
+/*
+ * Turn a private 2MB page into a page table of its 4KB pages, which
+ * become blocks of their own. NULL if the page is shared with another
+ * map or there is no page for the table.
+ */
+static uint64_t* split_large_page(uint64_t map, uint64_t *entry)
+{
+    uint64_t pa = PDE_ADDR(*entry);
+    uint64_t attribute = *entry & (PTE_P|PTE_W|PTE_U);
+    uint64_t *pt;
+
+    if (page_getref(pa) != 1 || (page_getflags(pa) & FRAME_RESERVED))
+        return NULL;
+
+    pt = (uint64_t*)pt_alloc(map);
+    if (pt == NULL)
+        return NULL;
+
+    for (int i = 0; i < 512; i++) {
+        struct PageFrame *frame = &page_frames[PAGE_INDEX(pa) + i];
+
+        frame->ref = 1;
+        frame->order = 0;
+        frame->flags = 0;
+        pt[i] = (pa + i * SMALL_PAGE_SIZE) | attribute;
+    }
+    *entry = V2P(pt) | PTE_P | PTE_W | (attribute & PTE_U);
+
+    return pt;
+}
+
+/* free the 4KB pages of a 2MB page which are inside the range */
+static void free_large_part(struct FreeRange *range, uint64_t *entry, uint64_t va)
+{
+    uint64_t start = va > range->start ? va : range->start;
+    uint64_t end = va + PAGE_SIZE < range->end ? va + PAGE_SIZE : range->end;
+    uint64_t *pt = split_large_page(range->map, entry);
+
+    if (pt == NULL) {
+        range->kept = true;
+        return;
+    }
+
+    for (; start < end; start += SMALL_PAGE_SIZE) {
+        uint64_t *pte = &pt[(start >> 12) & 0x1FF];
+
+        page_decref(PDE_ADDR(*pte));
+        *pte = 0;
+    }
+    add_flush_range(&range->flush, va, PAGE_SIZE);
+}
+
+static bool free_leaf(uint64_t *entry, uint64_t va, uint64_t size, void *arg)
+{
+    struct FreeRange *range = arg;
+
+    if (va < range->start || va + size > range->end) {
+        if (size == PAGE_SIZE)
+            free_large_part(range, entry, va);
+        else
+            range->kept = true;
+        return true;
+    }
+
+    if (*entry & PTE_P) {
+        page_decref(PDE_ADDR(*entry));
+        add_flush_range(&range->flush, va, size);
+    }
+    else {
+        swap_free(*entry);
+    }
+    *entry = 0;
+
+    return true;
+}
+
+/* a shared page table inside the range is let go of rather than copied */
+static int free_table(uint64_t *entry, uint64_t va, void *arg)
+{
+    struct FreeRange *range = arg;
+
+    if ((*entry & PTE_SHARED) && drop_shared_table(range->map, entry)) {
+        add_flush_range(&range->flush, va, PAGE_SIZE);
+        return WALK_SKIP;
+    }
+
+    return WALK_DESCEND;
+}
+
+/*
+ * Unmap and release the user pages in [vstart, vend), one TLB flush
+ * covers them all. A 2MB page only partly inside the range is split,
+ * false if one had to be kept because it is shared.
+ */
+bool free_pages(uint64_t map, uint64_t vstart, uint64_t vend)
+{
+    struct FreeRange range = { map, vstart, vend, { 0, 0 }, false };
+    struct PageWalk walk = { map, WALK_PRIVATE|WALK_SWAP, free_leaf, free_table, &range };
+
+    ASSERT(vstart % SMALL_PAGE_SIZE == 0);
+    ASSERT(vend % SMALL_PAGE_SIZE == 0);
+
+    walk_page_tables(&walk, vstart, vend);
+
+    if (range.flush.start != range.flush.end)
+        tlb_shootdown(map, range.flush.start, range.flush.end);
+
+    return !range.kept;
+}
+
+/* release the table pages under table, whose entries each map 1 << shift bytes */
+static void free_tables(uint64_t map, uint64_t *table, int shift)
+{
+    for (int i = 0; i < 512; i++) {
+        if ((table[i] & PTE_P) && (table[i] & PTE_ENTRY) == 0) {
+            uint64_t *next = (uint64_t*)P2V(PDE_ADDR(table[i]));
+
+            if (shift > 21)
+                free_tables(map, next, shift - 9);
+            if ((table[i] & PTE_SHARED) == 0 || !drop_shared_table(map, &table[i]))
+                pt_free(map, (uint64_t)next);
+        }
+        table[i] = 0;
+    }
+}
+
+static void free_pml4t(uint64_t map)
+{
+    kfree(map);
+}
+
+/* tear down the user half, the kernel tables are shared */
+void free_vm(uint64_t map, uint64_t size)
+{
+    uint64_t *pml4 = (uint64_t*)map;
+
+    free_pages(map, 0x400000, 0x400000 + PA_UP(size));
+
+    for (int i = 0; i < USER_PML4_ENTRIES; i++) {
+        if (pml4[i] & PTE_P) {
+            uint64_t *pdpt = (uint64_t*)P2V(PDE_ADDR(pml4[i]));
+
+            free_tables(map, pdpt, 30);
+            pt_free(map, (uint64_t)pdpt);
+            pml4[i] = 0;
+        }
+    }
+
+    free_pml4t(map);
+}
+
+static bool copy_leaf(uint64_t *entry, uint64_t va, uint64_t size, void *arg)
+{
+    uint64_t dst_map = *(uint64_t*)arg;
+    void *page = kalloc_pages(size == PAGE_SIZE ? PAGE_ORDER : 0);
+
+    if (page == NULL)
+        return false;
+
+    if ((*entry & PTE_P) == 0) {
+        if (!swap_read(*entry, page)) {
+            kfree((uint64_t)page);
+            return false;
+        }
+    }
+    else {
+        memcpy(page, (void*)P2V(PDE_ADDR(*entry)), size);
+    }
+
+    if (!map_pages(dst_map, va, va + size, V2P(page), PTE_P|PTE_W|PTE_U)) {
+        page_decref(V2P(page));
+        return false;
+    }
+
+    return true;
+}
+
+bool copy_uvm(uint64_t dst_map, uint64_t src_map, int size)
+{
+    uint64_t vend = 0x400000 + PA_UP(size);
+    struct PageWalk walk = { src_map, WALK_SWAP, copy_leaf, NULL, &dst_map };
+
+    if (!walk_page_tables(&walk, 0x400000, vend)) {
+        free_pages(dst_map, 0x400000, vend);
+        return false;
+    }
+
+    return true;
+}
+
+struct ShareRange {
+    uint64_t dst_map;
+    struct FlushRange flush;
+};
+
+static bool share_leaf(uint64_t *entry, uint64_t va, uint64_t size, void *arg)
+{
+    struct ShareRange *share = arg;
+    uint64_t pa = PDE_ADDR(*entry);
+
+    /* both sides decompress a copy of their own */
+    if ((*entry & PTE_P) == 0) {
+        PT pt = find_pdt_entry(share->dst_map, va, 1, PTE_P|PTE_W|PTE_U);
+        if (pt == NULL)
+            return false;
+        swap_dup(*entry);
+        pt[(va >> 12) & 0x1FF] = *entry;
+        return true;
+    }
+
+    *entry &= ~PTE_W;
+    add_flush_range(&share->flush, va, size);
+
+    if (!map_pages(share->dst_map, va, va + size, pa, PTE_P|PTE_U))
+        return false;
+
+    page_incref(pa);
+    return true;
+}
+
+/*
+ * Whole page tables are handed to dst_map as they are. Only the PDEs
+ * lose write access, which CR0.WP makes binding for the kernel too.
+ */
+static int share_table(uint64_t *entry, uint64_t va, void *arg)
+{
+    struct ShareRange *share = arg;
+    PD pd = find_pdpt_entry(share->dst_map, va, 1, PTE_P|PTE_W|PTE_U);
+    uint64_t *dst;
+
+    if (pd == NULL)
+        return WALK_ABORT;
+
+    dst = &pd[(va >> 21) & 0x1FF];
+    if (*dst & PTE_P)
+        return WALK_DESCEND;
+
+    spin_lock(&pt_share_lock);
+    page_incref(PDE_ADDR(*entry));
+    *entry = (*entry & ~PTE_W) | PTE_SHARED;
+    spin_unlock(&pt_share_lock);
+
+    *dst = *entry;
+    VM_CONTEXT(share->dst_map)->table_pages++;
+    add_flush_range(&share->flush, va, PAGE_SIZE);
+
+    return WALK_SKIP;
+}
+
+/*
+ * Map the pages of [vstart, vend) in src_map into dst_map as well.
+ * Both sides lose write access, the first write copies the page, or
+ * the page table first if it is shared as a whole.
+ */
+bool share_pages(uint64_t dst_map, uint64_t src_map, uint64_t vstart, uint64_t vend)
+{
+    struct ShareRange share = { dst_map, { 0, 0 } };
+    struct PageWalk walk = { src_map, WALK_PRIVATE|WALK_SWAP, share_leaf, share_table, &share };
+    bool status = walk_page_tables(&walk, vstart, vend);
+
+    /* the parent's pages are read-only now */
+    if (share.flush.start != share.flush.end)
+        tlb_shootdown(src_map, share.flush.start, share.flush.end);
+
+    return status;
+}
+
+bool share_uvm(uint64_t dst_map, uint64_t src_map, int size)
+{
+    return share_pages(dst_map, src_map, 0x400000, 0x400000 + PA_UP(size));
+}
+
+
+
+static bool count_node_pages(uint64_t *entry, uint64_t va, uint64_t size, void *arg)
+{
+    uint64_t *pages = arg;
+
+    pages[page_node(PDE_ADDR(*entry))] += size / SMALL_PAGE_SIZE;
+    return true;
+}
+
+/* where the pages mapped in the user half of map live, and how much is free */
+void get_numa_info(uint64_t map, struct NumaInfo *info)
+{
+    struct PageWalk walk = { map, 0, count_node_pages, NULL, info->pages };
+    int local = cpu_current()->node;
+
+    memset(info, 0, sizeof(struct NumaInfo));
+    info->nodes = node_count;
+    info->node = local;
+
+    for (int i = 0; i < node_count; i++) {
+        for (int order = 0; order <= MAX_ORDER; order++)
+            info->free_pages[i] += mem_nodes[i].free_count[order] << order;
+        info->distance[i] = mem_nodes[local].distance[i];
+    }
+
+    walk_page_tables(&walk, 0, USER_PML4_ENTRIES * PML4_ENTRY_SIZE);
+}
+
+struct UsageWalk {
+    struct PageUsage *usage;
+    /* the page table being walked is shared since fork */
+    bool shared_table;
+};
+
+static int count_usage_table(uint64_t *entry, uint64_t va, void *arg)
+{
+    struct UsageWalk *walk = arg;
+
+    walk->shared_table = (*entry & PTE_SHARED) != 0;
+    return WALK_DESCEND;
+}
+
+static bool count_usage_leaf(uint64_t *entry, uint64_t va, uint64_t size, void *arg)
+{
+    struct UsageWalk *walk = arg;
+    uint64_t pages = size / SMALL_PAGE_SIZE;
+    uint64_t pa = PDE_ADDR(*entry);
+
+    if ((*entry & PTE_P) == 0) {
+        walk->usage->swapped++;
+        return true;
+    }
+
+    walk->usage->resident += pages;
+    if ((size == SMALL_PAGE_SIZE && walk->shared_table) || page_getref(pa) > 1 ||
+        (page_getflags(pa) & FRAME_RESERVED))
+        walk->usage->shared += pages;
+
+    return true;
+}
+
+void get_page_usage(uint64_t map, struct PageUsage *usage)
+{
+    struct UsageWalk arg = { usage, false };
+    struct PageWalk walk = { map, WALK_SWAP, count_usage_leaf, count_usage_table, &arg };
+
+    memset(usage, 0, sizeof(struct PageUsage));
+    usage->tables = get_page_table_pages(map);
+
+    walk_page_tables(&walk, 0, USER_PML4_ENTRIES * PML4_ENTRY_SIZE);
+}
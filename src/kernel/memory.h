@@ -18,14 +18,104 @@ struct FreeMemRegion {
 
 struct Page {
     struct Page* next;
+    struct Page* prev;
 };
 
+/* per 4KB physical frame bookkeeping */
+struct PageFrame {
+    uint16_t ref;
+    uint8_t order;
+    uint8_t flags;
+    uint8_t node;
+};
+
+#define FRAME_FREE 1
+#define FRAME_SLAB 2
+/* not managed by the allocator, e.g. the FS image, never refcounted */
+#define FRAME_RESERVED 4
+/* read-only page standing in for identical pages of several processes, see ksm.c */
+#define FRAME_MERGED 8
+
+/* per-CPU cache of free 4KB pages in front of the buddy allocator */
+struct PageCache {
+    struct Page *pages;
+    int count;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+#define PAGE_CACHE_BATCH 16
+#define PAGE_CACHE_HIGH 64
+
+/* blocks of one order which have been zeroed ahead of time */
+struct ZeroPool {
+    struct Page *pages;
+    int order;
+    int count;
+    int target;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+#define ZERO_POOL_SMALL 64
+#define ZERO_POOL_LARGE 8
+
+/* state of an address space, kept in the page after its PML4 */
+struct VmContext {
+    uint64_t id;
+    uint64_t tlb_gen;
+    uint64_t table_pages;
+};
+
+#define VM_MAP_ORDER 1
+#define VM_CONTEXT(map) ((struct VmContext*)((uint64_t)(map) + SMALL_PAGE_SIZE))
+
+/* recently used maps of a CPU, slot n runs with PCID n+1 */
+struct AsidSlot {
+    uint64_t id;
+    uint64_t tlb_gen;
+};
+
+#define ASID_SLOTS 8
+
+/* a range another CPU asked this CPU to flush */
+struct TlbRequest {
+    volatile uint64_t map;
+    volatile uint64_t start;
+    volatile uint64_t end;
+    volatile uint64_t tlb_gen;
+    volatile int pending;
+};
+
+struct TlbState {
+    struct AsidSlot slots[ASID_SLOTS];
+    int next_slot;
+    int current_slot;
+    volatile uint64_t active_map;
+    struct TlbRequest request;
+    uint64_t flushes;
+    uint64_t invlpgs;
+};
+
+/* ranges up to this many pages are flushed with invlpg */
+#define TLB_FLUSH_PAGES 32
+
+/* page table pages are carved out of chunks of this order */
+#define PT_CHUNK_ORDER 4
+#define PT_FREE_HIGH 64
+
 /* reference counts for physical pages */
 void page_incref(uint64_t pa);
 void page_decref(uint64_t pa);
 uint16_t page_getref(uint64_t pa);
+uint8_t page_getflags(uint64_t pa);
+void page_setflags(uint64_t pa, uint8_t flags);
 bool share_uvm(uint64_t dst_map, uint64_t src_map, int size);
+bool share_pages(uint64_t dst_map, uint64_t src_map, uint64_t vstart, uint64_t vend);
+bool unshare_page_tables(uint64_t map, uint64_t va);
 
+typedef uint64_t PTE;
+typedef PTE* PT;
 typedef uint64_t PDE;
 typedef PDE* PD;
 typedef PD* PDPTR;
@@ -33,38 +123,159 @@ typedef PD* PDPTR;
 #define PTE_P 1
 #define PTE_W 2
 #define PTE_U 4
+#define PTE_A 0x20
 #define PTE_ENTRY 0x80
+#define PTE_G 0x100
+/* in a PDE: the page table is used by several maps, see unshare_page_table */
+#define PTE_SHARED 0x200
+/* in a PTE which is not present: the page sits in the compressed store, see swap.c */
+#define PTE_SWAP 0x400
+#define CR3_NOFLUSH (1ULL << 63)
+#define CR4_PGE (1 << 7)
+#define CR4_PCIDE (1 << 17)
 #define KERNEL_BASE 0xffff800000000000
 #define PAGE_SIZE (2*1024*1024)
+#define SMALL_PAGE_SIZE (4*1024)
+#define HUGE_PAGE_SIZE (1024*1024*1024ULL)
+#define PAGE_ORDER 9
+#define MAX_ORDER 18
+
+/* the boot page tables only map the first 1GB at KERNEL_BASE */
+#define BOOT_MAP_SIZE HUGE_PAGE_SIZE
+/* all of physical memory is mapped through a single PML4 slot */
+#define DIRECT_MAP_LIMIT (512*HUGE_PAGE_SIZE)
+/* vmalloc has a PML4 slot of its own */
+#define VMALLOC_BASE 0xffffc00000000000
+#define VMALLOC_END (VMALLOC_BASE + 512*HUGE_PAGE_SIZE)
 
+#define HPA_UP(v) ((((uint64_t)v + HUGE_PAGE_SIZE-1) >> 30) << 30)
 #define PA_UP(v) ((((uint64_t)v + PAGE_SIZE-1) >> 21) << 21)
 #define PA_DOWN(v) (((uint64_t)v >> 21) << 21)
+#define SPA_UP(v) ((((uint64_t)v + SMALL_PAGE_SIZE-1) >> 12) << 12)
+#define SPA_DOWN(v) (((uint64_t)v >> 12) << 12)
 #define P2V(p) ((uint64_t)(p) + KERNEL_BASE)
 #define V2P(v) ((uint64_t)(v) - KERNEL_BASE)
 #define PDE_ADDR(p) (((uint64_t)p >> 12) << 12)
 #define PTE_ADDR(p) (((uint64_t)p >> 21) << 21)
 
+/*
+ * Memory of one NUMA node. Free blocks never span two nodes, and the
+ * fallback list holds all nodes ordered by their distance to this one.
+ */
+#define MAX_NODES 8
+#define LOCAL_DISTANCE 10
+#define REMOTE_DISTANCE 20
+
+struct MemNode {
+    struct Page free_area[MAX_ORDER+1];
+    uint64_t free_count[MAX_ORDER+1];
+    uint64_t local_allocs;
+    uint64_t remote_allocs;
+    uint8_t distance[MAX_NODES];
+    int fallback[MAX_NODES];
+};
+
+/* what get_numa_info reports to user space */
+struct NumaInfo {
+    int nodes;
+    int node;
+    uint64_t pages[MAX_NODES];
+    uint64_t free_pages[MAX_NODES];
+    uint64_t distance[MAX_NODES];
+};
+
+/* what get_mem_stats reports to user space, in 4KB pages */
+struct MemStats {
+    uint64_t total_pages;
+    uint64_t free_pages;
+    /* free pages parked in the per-CPU caches and the zero pools */
+    uint64_t cached_pages;
+    uint64_t used_pages;
+    /* pages the compressed store uses, and the pages it holds */
+    uint64_t store_pages;
+    uint64_t stored_pages;
+    /* the deepest any kernel stack went, in bytes */
+    uint64_t stack_peak;
+};
+
+/* how the user half of a map is backed, in 4KB pages */
+struct PageUsage {
+    uint64_t resident;
+    /* resident pages other maps or the FS image use as well */
+    uint64_t shared;
+    uint64_t swapped;
+    uint64_t tables;
+};
+
 void* kalloc(void);
+void* kalloc_pages(int order);
+void* kalloc_zeroed(void);
+void* kalloc_pages_zeroed(int order);
+bool refill_zero_pool(void);
 void kfree(uint64_t v);
+uint64_t get_free_blocks(int order);
+uint64_t get_free_pages(void);
+int get_node_count(void);
+int page_node(uint64_t pa);
+void get_numa_info(uint64_t map, struct NumaInfo *info);
+void get_mem_stats(struct MemStats *stats);
+void print_page_fragmentation(void);
+uint64_t get_page_table_pages(uint64_t map);
+void get_page_usage(uint64_t map, struct PageUsage *usage);
+bool map_zero_page(uint64_t map, uint64_t va);
+bool is_zero_page(uint64_t pa);
+uint64_t get_zero_page(void);
+uint64_t get_zero_page_hits(void);
 void init_memory(void);
-void init_kvm(void);
 bool map_pages(uint64_t map, uint64_t v, uint64_t e, uint64_t pa, uint32_t attribute);
 void switch_vm(uint64_t map);
 void load_cr3(uint64_t map);
 void free_vm(uint64_t map, uint64_t size);
-void free_pages(uint64_t map, uint64_t vstart, uint64_t vend);
-void free_page(uint64_t map, uint64_t v, uint64_t e);
+bool free_pages(uint64_t map, uint64_t vstart, uint64_t vend);
 bool setup_uvm(uint64_t map, uint64_t start, int size);
+bool alloc_uvm(uint64_t map, uint64_t v, uint64_t e, uint32_t attribute);
 uint64_t setup_kvm(void);
+uint64_t get_kernel_map(void);
+void init_cpu_paging(void);
 uint64_t get_total_memory(void);
 bool copy_uvm(uint64_t dst_map, uint64_t src_map, int size);
 PD find_pdpt_entry(uint64_t map, uint64_t v, int alloc, uint32_t attribute);
+PT find_pdt_entry(uint64_t map, uint64_t v, int alloc, uint32_t attribute);
+uint64_t* find_page_entry(uint64_t map, uint64_t v, uint64_t *size);
+
+/* called for each present leaf entry, returning false ends the walk */
+typedef bool (*PageVisitor)(uint64_t *entry, uint64_t va, uint64_t size, void *arg);
+bool walk_page_range(uint64_t map, uint64_t start, uint64_t end, PageVisitor visit, void *arg);
+
+/* what a table visitor wants done with the page table it was shown */
+#define WALK_ABORT -1
+#define WALK_DESCEND 0
+#define WALK_SKIP 1
+
+/* shared page tables are copied before their entries are visited */
+#define WALK_PRIVATE 1
+/* entries of swapped out pages are visited too */
+#define WALK_SWAP 2
+
+typedef int (*TableVisitor)(uint64_t *entry, uint64_t va, void *arg);
+
+struct PageWalk {
+    uint64_t map;
+    int flags;
+    PageVisitor visit;
+    /* sees PDEs of page tables wholly inside the range first */
+    TableVisitor visit_table;
+    void *arg;
+};
+
+bool walk_page_tables(struct PageWalk *walk, uint64_t start, uint64_t end);
 
 void init_kheap(void);
 void *kmalloc(size_t size);
 void kmfree(void *ptr);
 
-void invalidate_tlb(void);
+uint64_t flush_tlb_begin(uint64_t map);
+void flush_tlb_local(uint64_t map, uint64_t start, uint64_t end, uint64_t tlb_gen);
 
 
 #endif
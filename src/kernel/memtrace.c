@@ -0,0 +1,249 @@
+#include "memtrace.h"
+#include "print.h"
+#include "lib.h"
+#include "stddef.h"
+
+/*
+ * Allocation tracing for kalloc, kfree, kmalloc and kmfree, off until
+ * started. Each allocation is charged to the return address of the
+ * call that handed it out, so an allocator which calls another one
+ * first records the block under its own caller and then the outer
+ * call takes it over. Live blocks are found by address when freed,
+ * blocks handed out before tracing started are ignored.
+ */
+
+#define TRACE_SITES 128
+#define TRACE_RECORDS 4096
+#define TRACE_BUCKETS 1024
+#define TRACE_NONE 0xffff
+/* sizes from 16 bytes up to 1GB, by powers of two */
+#define SIZE_SHIFT 4
+#define SIZE_CLASSES 27
+#define LEAKS_SHOWN 4
+
+struct TraceSite {
+    uint64_t caller;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t failures;
+    uint64_t live_bytes;
+    uint64_t peak_bytes;
+    uint32_t sizes[SIZE_CLASSES];
+};
+
+struct TraceRecord {
+    uint64_t addr;
+    uint32_t size;
+    uint16_t site;
+    uint16_t next;
+};
+
+static struct TraceSite sites[TRACE_SITES];
+static int site_count;
+static struct TraceRecord records[TRACE_RECORDS];
+static uint16_t buckets[TRACE_BUCKETS];
+static uint16_t free_records;
+static uint64_t dropped;
+static bool tracing;
+static struct SpinLock trace_lock;
+
+static int size_class(uint64_t size)
+{
+    int class = 0;
+
+    while (class < SIZE_CLASSES - 1 && (1ULL << (class + SIZE_SHIFT)) < size)
+        class++;
+
+    return class;
+}
+
+/* the last site takes every caller once the table is full */
+static struct TraceSite* find_site(uint64_t caller)
+{
+    for (int i = 0; i < site_count; i++) {
+        if (sites[i].caller == caller)
+            return &sites[i];
+    }
+
+    if (site_count == TRACE_SITES)
+        return &sites[TRACE_SITES - 1];
+
+    sites[site_count].caller = caller;
+    return &sites[site_count++];
+}
+
+static uint16_t* find_record(uint64_t addr)
+{
+    uint16_t *link = &buckets[(addr >> SIZE_SHIFT) % TRACE_BUCKETS];
+
+    while (*link != TRACE_NONE && records[*link].addr != addr)
+        link = &records[*link].next;
+
+    return link;
+}
+
+static void charge(struct TraceSite *site, uint64_t size)
+{
+    site->live_bytes += size;
+    if (site->live_bytes > site->peak_bytes)
+        site->peak_bytes = site->live_bytes;
+}
+
+void trace_alloc(void *ptr, uint64_t size, void *caller)
+{
+    if (!tracing)
+        return;
+
+    spin_lock(&trace_lock);
+
+    struct TraceSite *site = find_site((uint64_t)caller);
+
+    if (ptr == NULL) {
+        site->failures++;
+        spin_unlock(&trace_lock);
+        return;
+    }
+
+    site->allocs++;
+    site->sizes[size_class(size)]++;
+
+    uint16_t *link = find_record((uint64_t)ptr);
+    struct TraceRecord *record;
+
+    if (*link != TRACE_NONE) {
+        /* an inner allocator recorded the block first */
+        record = &records[*link];
+        struct TraceSite *inner = &sites[record->site];
+        inner->allocs--;
+        inner->sizes[size_class(record->size)]--;
+        inner->live_bytes -= record->size;
+    }
+    else if (free_records != TRACE_NONE) {
+        record = &records[free_records];
+        free_records = record->next;
+        record->addr = (uint64_t)ptr;
+        record->next = TRACE_NONE;
+        *link = record - records;
+    }
+    else {
+        dropped++;
+        spin_unlock(&trace_lock);
+        return;
+    }
+
+    record->size = (uint32_t)size;
+    record->site = site - sites;
+    charge(site, size);
+
+    spin_unlock(&trace_lock);
+}
+
+void trace_free(void *ptr)
+{
+    if (!tracing || ptr == NULL)
+        return;
+
+    spin_lock(&trace_lock);
+
+    uint16_t *link = find_record((uint64_t)ptr);
+    if (*link != TRACE_NONE) {
+        struct TraceRecord *record = &records[*link];
+        struct TraceSite *site = &sites[record->site];
+
+        site->frees++;
+        site->live_bytes -= record->size;
+
+        *link = record->next;
+        record->next = free_records;
+        free_records = record - records;
+    }
+
+    spin_unlock(&trace_lock);
+}
+
+/* start over with empty tables, false if tracing was on already */
+bool start_alloc_trace(void)
+{
+    spin_lock(&trace_lock);
+
+    if (tracing) {
+        spin_unlock(&trace_lock);
+        return false;
+    }
+
+    memset(sites, 0, sizeof(sites));
+    site_count = 0;
+    dropped = 0;
+
+    for (int i = 0; i < TRACE_BUCKETS; i++)
+        buckets[i] = TRACE_NONE;
+    for (int i = 0; i < TRACE_RECORDS; i++)
+        records[i].next = i + 1 < TRACE_RECORDS ? i + 1 : TRACE_NONE;
+    free_records = 0;
+
+    tracing = true;
+    spin_unlock(&trace_lock);
+
+    return true;
+}
+
+void stop_alloc_trace(void)
+{
+    tracing = false;
+}
+
+bool is_alloc_tracing(void)
+{
+    return tracing;
+}
+
+static void print_leaks(struct TraceSite *site)
+{
+    int index = site - sites;
+    int shown = 0;
+
+    printk("%x holds", site->caller);
+    for (int i = 0; i < TRACE_RECORDS && shown < LEAKS_SHOWN; i++) {
+        if (records[i].site == index && *find_record(records[i].addr) == i) {
+            printk(" %x/%u", records[i].addr, records[i].size);
+            shown++;
+        }
+    }
+    if (site->allocs - site->frees > (uint64_t)shown)
+        printk(" and %u more", site->allocs - site->frees - shown);
+    printk("\n");
+}
+
+/* per caller counts and sizes, then the blocks each caller still holds */
+void print_alloc_trace(void)
+{
+    spin_lock(&trace_lock);
+
+    printk("alloc trace %s, %u sites, %u dropped\n", tracing ? "on" : "off", site_count, dropped);
+    printk("caller allocs frees failed live peak\n");
+
+    for (int i = 0; i < site_count; i++) {
+        struct TraceSite *site = &sites[i];
+
+        /* inner allocators whose blocks all went to their callers */
+        if (site->allocs == 0 && site->failures == 0)
+            continue;
+
+        printk("%x %u %u %u %u %u\n", site->caller, site->allocs, site->frees,
+               site->failures, site->live_bytes, site->peak_bytes);
+
+        printk("   sizes:");
+        for (int class = 0; class < SIZE_CLASSES; class++) {
+            if (site->sizes[class] != 0)
+                printk(" %u:%u", 1ULL << (class + SIZE_SHIFT), site->sizes[class]);
+        }
+        printk("\n");
+    }
+
+    for (int i = 0; i < site_count; i++) {
+        if (sites[i].allocs > sites[i].frees)
+            print_leaks(&sites[i]);
+    }
+
+    spin_unlock(&trace_lock);
+}
@@ -0,0 +1,18 @@
+#ifndef _MEMTRACE_H_
+#define _MEMTRACE_H_
+
+#include "stdint.h"
+#include "stdbool.h"
+
+#define TRACE_STOP 0
+#define TRACE_START 1
+#define TRACE_DUMP 2
+
+void trace_alloc(void *ptr, uint64_t size, void *caller);
+void trace_free(void *ptr);
+bool start_alloc_trace(void);
+void stop_alloc_trace(void);
+bool is_alloc_tracing(void);
+void print_alloc_trace(void);
+
+#endif
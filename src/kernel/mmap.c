@@ -0,0 +1,348 @@
+#include "mmap.h"
+#include "process.h"
+#include "memory.h"
+#include "slab.h"
+#include "lib.h"
+#include "debug.h"
+
+/*
+ * File mappings point straight at the FS image in memory. A page is
+ * mapped on first touch: when its bytes sit in consecutive clusters and
+ * the page is aligned in physical memory, the image frame itself is
+ * mapped read-only. Everything else gets a private copy. Writes to a
+ * MAP_WRITE mapping go through the usual copy-on-write path.
+ *
+ * exec records the loadable segments of a program the same way, so only
+ * the pages a program touches are ever read. Bytes past file_end, such
+ * as .bss, are zero.
+ */
+
+static struct KmemCache *vm_area_cache;
+
+struct VmArea *find_vm_area(struct Process *proc, uint64_t addr)
+{
+    for (struct VmArea *area = proc->vm_areas; area != NULL; area = area->next) {
+        if (addr < area->start)
+            break;
+        if (addr < area->end)
+            return area;
+    }
+
+    return NULL;
+}
+
+/* first gap of length bytes in the window, the list is kept sorted */
+static uint64_t find_free_range(struct Process *proc, uint64_t length)
+{
+    uint64_t start = MMAP_BASE;
+
+    for (struct VmArea *area = proc->vm_areas; area != NULL; area = area->next) {
+        /* the program image sits below the window */
+        if (area->end <= start)
+            continue;
+        if (area->start - start >= length)
+            break;
+        start = area->end;
+    }
+
+    if (start + length > MMAP_END)
+        return 0;
+
+    return start;
+}
+
+static void insert_vm_area(struct Process *proc, struct VmArea *area)
+{
+    struct VmArea **link = &proc->vm_areas;
+
+    while (*link != NULL && (*link)->start < area->start)
+        link = &(*link)->next;
+
+    area->next = *link;
+    *link = area;
+}
+
+static bool add_vm_area(struct Process *proc, uint64_t start, uint64_t end, uint32_t flags,
+                        struct FileCursor *file, uint32_t offset, uint32_t file_end)
+{
+    struct VmArea *area = kmem_cache_alloc(vm_area_cache);
+    if (area == NULL)
+        return false;
+
+    area->start = start;
+    area->end = end;
+    area->flags = flags;
+    area->offset = offset;
+    area->file_end = file_end;
+    area->file = *file;
+    insert_vm_area(proc, area);
+
+    return true;
+}
+
+int64_t mmap_file(struct Process *proc, int fd, uint32_t offset, uint32_t length, int flags)
+{
+    struct FileCursor cursor;
+
+    if (length == 0 || offset % SMALL_PAGE_SIZE != 0)
+        return -1;
+
+    if (!get_file_cursor(proc, fd, &cursor) || offset >= cursor.file_size)
+        return -1;
+
+    uint64_t size = SPA_UP((uint64_t)length);
+    uint64_t start = find_free_range(proc, size);
+    if (start == 0)
+        return -1;
+
+    uint32_t area_flags = VM_FILE;
+    if (flags & MAP_WRITE)
+        area_flags |= VM_WRITE;
+
+    if (!add_vm_area(proc, start, start + size, area_flags, &cursor, offset, cursor.file_size))
+        return -1;
+
+    return start;
+}
+
+/*
+ * File bytes [offset, offset+filesz) appear at vaddr, the rest up to
+ * memsz is zero. A segment may start in the last page of the one below
+ * it, as data follows text. That page gets an area of its own which
+ * sees the file bytes of both and is writable if either one is.
+ */
+bool add_vm_segment(struct Process *proc, struct FileCursor *file, uint64_t vaddr, uint64_t memsz,
+                    uint32_t offset, uint32_t filesz, uint32_t flags)
+{
+    uint64_t start = SPA_DOWN(vaddr);
+    uint64_t end = SPA_UP(vaddr + memsz);
+    uint32_t skew = (uint32_t)(vaddr - start);
+    uint32_t file_start = offset - skew;
+    struct VmArea *below;
+
+    if (offset % SMALL_PAGE_SIZE != skew || filesz > memsz)
+        return false;
+
+    flags |= VM_FILE | VM_IMAGE;
+    below = find_vm_area(proc, start);
+
+    if (below != NULL) {
+        /* only the last page may be shared and it has to be the same
+           page of the file in both */
+        if (!(below->flags & VM_IMAGE) || below->end != start + SMALL_PAGE_SIZE ||
+            below->offset + (uint32_t)(start - below->start) != file_start ||
+            below->file_end > offset)
+            return false;
+
+        if (below->start == start) {
+            below->flags |= flags;
+            below->file_end = offset + filesz;
+        } else {
+            if (!add_vm_area(proc, start, start + SMALL_PAGE_SIZE, below->flags | flags,
+                             file, file_start, offset + filesz))
+                return false;
+            below->end = start;
+        }
+
+        start += SMALL_PAGE_SIZE;
+        file_start += SMALL_PAGE_SIZE;
+        if (start >= end)
+            return true;
+    }
+
+    return add_vm_area(proc, start, end, flags, file, file_start, offset + filesz);
+}
+
+/* only whole mappings inside the range are removed */
+int munmap_range(struct Process *proc, uint64_t addr, uint64_t length)
+{
+    struct VmArea **link = &proc->vm_areas;
+    uint64_t end = addr + SPA_UP(length);
+    int count = 0;
+
+    if (addr % SMALL_PAGE_SIZE != 0 || length == 0)
+        return -1;
+
+    while (*link != NULL) {
+        struct VmArea *area = *link;
+
+        if (!(area->flags & VM_IMAGE) && area->start >= addr && area->end <= end) {
+            *link = area->next;
+            free_pages(proc->page_map, area->start, area->end);
+            kmem_cache_free(vm_area_cache, area);
+            count++;
+        } else {
+            link = &area->next;
+        }
+    }
+
+    return count > 0 ? 0 : -1;
+}
+
+int fault_vm_area(struct Process *proc, struct VmArea *area, uint64_t addr, bool write)
+{
+    uint64_t va = SPA_DOWN(addr);
+    uint32_t offset = area->offset + (uint32_t)(va - area->start);
+    uint64_t pa;
+
+    /* past the file data reads see the zero page until the first write */
+    if (offset >= area->file_end && !write)
+        return map_zero_page(proc->page_map, va) ? 0 : -1;
+
+    if (offset + SMALL_PAGE_SIZE <= area->file_end) {
+        pa = get_file_extent(&area->file, offset, SMALL_PAGE_SIZE);
+        if (pa != 0 && pa % SMALL_PAGE_SIZE == 0)
+            return map_pages(proc->page_map, va, va + SMALL_PAGE_SIZE, pa, PTE_P|PTE_U) ? 0 : -1;
+    }
+
+    /* the tail of the file, a fragmented chain or zero fill */
+    void *page = kalloc_zeroed();
+    if (page == NULL)
+        return -1;
+
+    if (offset < area->file_end) {
+        uint32_t size = area->file_end - offset;
+        read_file_at(&area->file, page, offset, size < SMALL_PAGE_SIZE ? size : SMALL_PAGE_SIZE);
+    }
+
+    uint32_t attr = PTE_P|PTE_U;
+    if (area->flags & VM_WRITE)
+        attr |= PTE_W;
+
+    if (!map_pages(proc->page_map, va, va + SMALL_PAGE_SIZE, V2P(page), attr)) {
+        kfree((uint64_t)page);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* first area which starts above addr */
+static struct VmArea *next_vm_area(struct Process *proc, uint64_t addr)
+{
+    struct VmArea *area = proc->vm_areas;
+
+    while (area != NULL && area->start <= addr)
+        area = area->next;
+
+    return area;
+}
+
+/* every page of the range lies in an area or in the heap below brk */
+static bool range_in_use(struct Process *proc, uint64_t start, uint64_t end)
+{
+    while (start < end) {
+        struct VmArea *area = find_vm_area(proc, start);
+
+        if (area != NULL) {
+            start = area->end;
+            continue;
+        }
+
+        area = next_vm_area(proc, start);
+        start = area != NULL && area->start < end ? area->start : end;
+        if (start > SPA_UP(proc->brk))
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Map every page of [start, end) now instead of on first touch. The
+ * range is checked first, so a bad range maps nothing.
+ */
+static int populate_range(struct Process *proc, uint64_t start, uint64_t end)
+{
+    if (!range_in_use(proc, start, end))
+        return -1;
+
+    while (start < end) {
+        struct VmArea *area = find_vm_area(proc, start);
+        uint64_t stop;
+
+        if (area != NULL) {
+            bool write = (area->flags & VM_WRITE) != 0;
+
+            stop = area->end < end ? area->end : end;
+            for (; start < stop; start += SMALL_PAGE_SIZE) {
+                uint64_t size;
+                if (find_page_entry(proc->page_map, start, &size) == NULL &&
+                    fault_vm_area(proc, area, start, write) < 0)
+                    return -1;
+            }
+            continue;
+        }
+
+        area = next_vm_area(proc, start);
+        stop = area != NULL && area->start < end ? area->start : end;
+        if (!alloc_uvm(proc->page_map, start, stop, PTE_P|PTE_W|PTE_U))
+            return -1;
+        start = stop;
+    }
+
+    return 0;
+}
+
+/*
+ * MADV_POPULATE maps the whole range up front. MADV_DONTNEED gives the
+ * pages back without moving brk, the next touch sees zeroes or the
+ * file contents again. It fails if a large page only partly inside
+ * the range is shared and has to stay.
+ */
+int madvise_range(struct Process *proc, uint64_t addr, uint64_t length, int advice)
+{
+    uint64_t end = SPA_UP(addr + length);
+
+    addr = SPA_DOWN(addr);
+    if (length == 0 || addr < 0x400000 || end > MMAP_END || end < addr)
+        return -1;
+
+    switch (advice) {
+        case MADV_POPULATE:
+            return populate_range(proc, addr, end);
+
+        case MADV_DONTNEED:
+            return free_pages(proc->page_map, addr, end) ? 0 : -1;
+
+        default:
+            return -1;
+    }
+}
+
+/* pages of the program image sit below brk and are shared with the heap */
+bool copy_vm_areas(struct Process *child, struct Process *parent)
+{
+    for (struct VmArea *area = parent->vm_areas; area != NULL; area = area->next) {
+        struct VmArea *copy = kmem_cache_alloc(vm_area_cache);
+        if (copy == NULL)
+            return false;
+
+        *copy = *area;
+        copy->next = NULL;
+        insert_vm_area(child, copy);
+
+        if (area->flags & VM_IMAGE)
+            continue;
+
+        if (!share_pages(child->page_map, parent->page_map, area->start, area->end))
+            return false;
+    }
+
+    return true;
+}
+
+void free_vm_areas(struct Process *proc)
+{
+    while (proc->vm_areas != NULL) {
+        struct VmArea *area = proc->vm_areas;
+        proc->vm_areas = area->next;
+        free_pages(proc->page_map, area->start, area->end);
+        kmem_cache_free(vm_area_cache, area);
+    }
+}
+
+void init_mmap(void)
+{
+    vm_area_cache = kmem_cache_create("vm_area", sizeof(struct VmArea));
+}
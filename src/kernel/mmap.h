@@ -0,0 +1,46 @@
+#ifndef _MMAP_H_
+#define _MMAP_H_
+
+#include "stdint.h"
+#include "stdbool.h"
+#include "file.h"
+
+/* mappings live above the heap, below 2GB so addresses fit the int return */
+#define MMAP_BASE 0x40000000
+#define MMAP_END 0x80000000
+
+/* user flag: private writable copy, otherwise the mapping is shared read-only */
+#define MAP_WRITE 1
+
+/* madvise advice */
+#define MADV_DONTNEED 1
+#define MADV_POPULATE 2
+
+#define VM_WRITE 1
+#define VM_FILE 2
+#define VM_IMAGE 4
+
+struct VmArea {
+    uint64_t start;
+    uint64_t end;
+    uint32_t flags;
+    uint32_t offset;
+    uint32_t file_end;
+    struct FileCursor file;
+    struct VmArea *next;
+};
+
+struct Process;
+
+void init_mmap(void);
+int64_t mmap_file(struct Process *proc, int fd, uint32_t offset, uint32_t length, int flags);
+bool add_vm_segment(struct Process *proc, struct FileCursor *file, uint64_t vaddr, uint64_t memsz,
+                    uint32_t offset, uint32_t filesz, uint32_t flags);
+int munmap_range(struct Process *proc, uint64_t addr, uint64_t length);
+struct VmArea *find_vm_area(struct Process *proc, uint64_t addr);
+int fault_vm_area(struct Process *proc, struct VmArea *area, uint64_t addr, bool write);
+int madvise_range(struct Process *proc, uint64_t addr, uint64_t length, int advice);
+bool copy_vm_areas(struct Process *child, struct Process *parent);
+void free_vm_areas(struct Process *proc);
+
+#endif
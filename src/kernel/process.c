@@ -6,15 +6,20 @@
 #include "debug.h"
 #include "cpu.h"
 #include "elf.h"
-
-extern struct TSS Tss;
-static struct Process process_table[NUM_PROC];
+#include "slab.h"
+#include "mmap.h"
+#include "swap.h"
+#include "ksm.h"
+#include "kstack.h"
+
+static struct Process *process_table[NUM_PROC];
+static struct KmemCache *process_cache;
 static int pid_num = 1;
 static const int time_slice_table[MAX_PRIORITY] = {1, 2, 4, 8};
 
 static void set_tss(struct Process *proc)
 {
-    Tss.rsp0 = proc->stack + STACK_SIZE;    
+    cpu_current()->tss.rsp0 = proc->stack + KSTACK_SIZE;
 }
 
 static struct Process* find_unused_process(void)
@@ -22,8 +27,13 @@ static struct Process* find_unused_process(void)
     struct Process *process = NULL;
 
     for (int i = 0; i < NUM_PROC; i++) {
-        if (process_table[i].state == PROC_UNUSED) {
-            process = &process_table[i];
+        if (process_table[i] == NULL) {
+            process = kmem_cache_alloc(process_cache);
+            if (process == NULL)
+                break;
+
+            memset(process, 0, sizeof(struct Process));
+            process_table[i] = process;
             break;
         }
     }
@@ -31,6 +41,18 @@ static struct Process* find_unused_process(void)
     return process;
 }
 
+static void free_process(struct Process *process)
+{
+    for (int i = 0; i < NUM_PROC; i++) {
+        if (process_table[i] == process) {
+            process_table[i] = NULL;
+            break;
+        }
+    }
+
+    kmem_cache_free(process_cache, process);
+}
+
 static struct Process* alloc_new_process(void)
 {
     uint64_t stack_top;
@@ -46,18 +68,18 @@ static struct Process* alloc_new_process(void)
     proc->priority = 1;
     proc->time_slice = time_slice_table[proc->priority];
     proc->runtime = 0;
-    proc->cpu_id = cpu_current()->id;
+    proc->cpu_id = cpu_id();
 
-    proc->stack = (uint64_t)kalloc();
+    proc->stack = alloc_kernel_stack();
     if (proc->stack == 0) {
+        free_process(proc);
         return NULL;
     }
 
-    memset((void*)proc->stack, 0, PAGE_SIZE);   
-    stack_top = proc->stack + STACK_SIZE;
+    stack_top = proc->stack + KSTACK_SIZE;
 
     proc->context = stack_top - sizeof(struct TrapFrame) - 7*8;   
-    *(uint64_t*)(proc->context + 6*8) = (uint64_t)TrapReturn;
+    *(uint64_t*)(proc->context + 6*8) = (uint64_t)ProcessStart;
 
     proc->tf = (struct TrapFrame*)(stack_top - sizeof(struct TrapFrame)); 
     proc->tf->cs = 0x10|3;
@@ -69,42 +91,111 @@ static struct Process* alloc_new_process(void)
     
     proc->page_map = setup_kvm();
     if (proc->page_map == 0) {
-        kfree(proc->stack);
-        memset(proc, 0, sizeof(struct Process));
+        free_kernel_stack(proc->stack);
+        free_process(proc);
         return NULL;
     }
 
     return proc;    
 }
 
+/* the process in slot index of the process table, NULL if the slot is free */
+struct Process* get_process(int index)
+{
+    if (index < 0 || index >= NUM_PROC)
+        return NULL;
+
+    return process_table[index];
+}
+
+/* fill in stats for up to count processes, the idle processes are left out */
+int get_proc_stats(struct ProcStats *stats, int count)
+{
+    int n = 0;
+
+    for (int i = 0; i < NUM_PROC && n < count; i++) {
+        struct Process *proc = process_table[i];
+        struct PageUsage usage;
+
+        if (proc == NULL || proc->pid == 0 || proc->page_map == 0)
+            continue;
+
+        get_page_usage(proc->page_map, &usage);
+
+        stats[n].pid = proc->pid;
+        stats[n].state = proc->state;
+        stats[n].runtime = proc->runtime;
+        stats[n].brk = proc->brk;
+        stats[n].resident_pages = usage.resident;
+        stats[n].shared_pages = usage.shared;
+        stats[n].swapped_pages = usage.swapped;
+        stats[n].table_pages = usage.tables;
+        stats[n].minor_faults = proc->minor_faults;
+        stats[n].cow_faults = proc->cow_faults;
+        stats[n].zero_faults = proc->zero_faults;
+        stats[n].swap_faults = proc->swap_faults;
+        stats[n].stack_used = kernel_stack_used(proc->stack);
+        n++;
+    }
+
+    return n;
+}
+
 struct ProcessControl* get_pc(void)
 {
     struct CPU *cpu = cpu_current();
     return &cpu->pc;
 }
 
-static void init_idle_process(void)
+static void setup_idle_process(struct Process *process, int cpu)
 {
-    struct Process *process;
-    struct ProcessControl *process_control;
-
-    process = find_unused_process();
-    ASSERT(process == &process_table[0]);
+    struct ProcessControl *process_control = &cpus[cpu].pc;
 
     process->pid = 0;
-    process->page_map = P2V(read_cr3());
+    process->page_map = get_kernel_map();
     process->state = PROC_RUNNING;
     process->priority = MAX_PRIORITY - 1;
-    process->cpu_id = 0;
+    process->cpu_id = cpu;
     process->brk = 0;
     process->time_slice = time_slice_table[process->priority];
     process->runtime = 0;
 
-    process_control = get_pc();
     process_control->current_process = process;
+    process_control->idle_process = process;
     process_control->need_resched = 0;
 }
 
+static void init_idle_process(void)
+{
+    struct Process *process;
+
+    process = find_unused_process();
+    ASSERT(process != NULL && process == process_table[0]);
+    setup_idle_process(process, 0);
+}
+
+/*
+ * The idle process of an AP which is about to start. The AP boots on
+ * its stack. Only the idle process of the boot CPU is in the table.
+ */
+struct Process* create_idle_process(int cpu)
+{
+    struct Process *process = kmem_cache_alloc(process_cache);
+
+    if (process == NULL)
+        return NULL;
+
+    memset(process, 0, sizeof(struct Process));
+    process->stack = alloc_kernel_stack();
+    if (process->stack == 0) {
+        kmem_cache_free(process_cache, process);
+        return NULL;
+    }
+
+    setup_idle_process(process, cpu);
+    return process;
+}
+
 static void init_user_process(void)
 {
     struct ProcessControl *process_control;
@@ -118,7 +209,10 @@ static void init_user_process(void)
 
     list = &process_control->ready_list[process->priority];
 
-    ASSERT(load_elf(process, (void*)P2V(0x30000)) == true);
+    int fd = open_file(process, "USER.ELF");
+    ASSERT(fd != -1);
+    ASSERT(load_elf(process, fd) == true);
+    close_file(process, fd);
 
     process->state = PROC_READY;
     append_list_tail(list, (struct List*)process);
@@ -126,10 +220,48 @@ static void init_user_process(void)
 
 void init_process(void)
 {
+    process_cache = kmem_cache_create("process", sizeof(struct Process));
     init_idle_process();
     init_user_process();
 }
 
+/* schedule takes ready processes from other CPUs as well */
+static bool has_ready_process(void)
+{
+    for (int cpu = 0; cpu < cpu_count; cpu++) {
+        struct ProcessControl *process_control = &cpus[cpu].pc;
+
+        for (int i = 0; i < MAX_PRIORITY; i++) {
+            if (!is_list_empty(&process_control->ready_list[i]))
+                return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * The thread each CPU boots on becomes its idle process, it comes here
+ * holding the kernel lock. Spare time goes into zeroing pages ahead of
+ * the fault paths and into evicting cold pages while memory is low. The
+ * CPU halts once there is nothing left to do, without the lock.
+ */
+void idle(void)
+{
+    while (1) {
+        if (has_ready_process()) {
+            yield();
+            continue;
+        }
+
+        if (!refill_zero_pool() && !reclaim_idle_memory() && !scan_merge_pages()) {
+            unlock_kernel();
+            halt();
+            lock_kernel();
+        }
+    }
+}
+
 void set_process_priority(struct Process *proc, int priority)
 {
     if (priority < 0)
@@ -141,15 +273,17 @@ void set_process_priority(struct Process *proc, int priority)
 
 void boost_ready_processes(void)
 {
-    struct ProcessControl *pc = get_pc();
-    struct HeadList *dest = &pc->ready_list[0];
-    for (int pr = 1; pr < MAX_PRIORITY; pr++) {
-        struct HeadList *list = &pc->ready_list[pr];
-        while (!is_list_empty(list)) {
-            struct Process *p = (struct Process*)remove_list_head(list);
-            p->priority = 0;
-            p->time_slice = time_slice_table[p->priority];
-            append_list_tail(dest, (struct List*)p);
+    for (int cpu = 0; cpu < cpu_count; cpu++) {
+        struct ProcessControl *pc = &cpus[cpu].pc;
+        struct HeadList *dest = &pc->ready_list[0];
+        for (int pr = 1; pr < MAX_PRIORITY; pr++) {
+            struct HeadList *list = &pc->ready_list[pr];
+            while (!is_list_empty(list)) {
+                struct Process *p = (struct Process*)remove_list_head(list);
+                p->priority = 0;
+                p->time_slice = time_slice_table[p->priority];
+                append_list_tail(dest, (struct List*)p);
+            }
         }
     }
 }
@@ -199,17 +333,17 @@ static void schedule(void)
         }
     }
 
-    if (current_proc == NULL) {
-        ASSERT(process_control->current_process->pid != 0);
-        current_proc = &process_table[0];
-    }
+    /* another CPU may have taken what this one was woken up for */
+    if (current_proc == NULL)
+        current_proc = process_control->idle_process;
 
     current_proc->state = PROC_RUNNING;
-    current_proc->cpu_id = cpu_current()->id;
+    current_proc->cpu_id = cpu_id();
     current_proc->time_slice = time_slice_table[current_proc->priority];
     process_control->current_process = current_proc;
 
-    switch_process(prev_proc, current_proc);
+    if (current_proc != prev_proc)
+        switch_process(prev_proc, current_proc);
 }
 
 void yield(void)
@@ -248,6 +382,7 @@ void sleep(int wait)
     schedule();
 }
 
+/* processes sleep on the CPU they ran on, the timer only ticks on one */
 void wake_up(int wait)
 {
     struct ProcessControl *process_control;
@@ -255,15 +390,17 @@ void wake_up(int wait)
     struct HeadList *ready_list;
     struct HeadList *wait_list;
 
-    process_control = get_pc();
-    wait_list = &process_control->wait_list;
-    process = (struct Process*)remove_list(wait_list, wait);
-
-    while (process != NULL) {
-        process->state = PROC_READY;
-        ready_list = &process_control->ready_list[process->priority];
-        append_list_tail(ready_list, (struct List*)process);
+    for (int cpu = 0; cpu < cpu_count; cpu++) {
+        process_control = &cpus[cpu].pc;
+        wait_list = &process_control->wait_list;
         process = (struct Process*)remove_list(wait_list, wait);
+
+        while (process != NULL) {
+            process->state = PROC_READY;
+            ready_list = &process_control->ready_list[process->priority];
+            append_list_tail(ready_list, (struct List*)process);
+            process = (struct Process*)remove_list(wait_list, wait);
+        }
     }
     reschedule_other_cpus();
 }
@@ -287,38 +424,43 @@ void exit(void)
     reschedule_other_cpus();
 }
 
+/* the child may have exited on any CPU */
+static struct Process* find_killed_process(int pid)
+{
+    for (int cpu = 0; cpu < cpu_count; cpu++) {
+        struct HeadList *list = &cpus[cpu].pc.kill_list;
+
+        if (!is_list_empty(list)) {
+            struct Process *process = (struct Process*)remove_list(list, pid);
+            if (process != NULL)
+                return process;
+        }
+    }
+
+    return NULL;
+}
+
 void wait(int pid)
 {
-    struct ProcessControl *process_control;
     struct Process *process;
-    struct HeadList *list;
-
-    process_control = get_pc();
-    list = &process_control->kill_list;
 
     while (1) {
-        if (!is_list_empty(list)) {
-            process = (struct Process*)remove_list(list, pid); 
-            if (process != NULL) {
-                ASSERT(process->state == PROC_KILLED);
-                kfree(process->stack);
-                free_vm(process->page_map, process->brk - 0x400000);
-
-                for (int i = 0; i < 100; i++) {
-                    if (process->file[i] != NULL) {
-                        process->file[i]->fcb->count--;
-                        process->file[i]->count--;
-
-                        if (process->file[i]->count == 0) {
-                            process->file[i]->fcb = NULL;
-                        }
-                    }
+        process = find_killed_process(pid);
+        if (process != NULL) {
+            ASSERT(process->state == PROC_KILLED);
+            free_kernel_stack(process->stack);
+            free_vm_areas(process);
+            free_vm(process->page_map, process->brk - 0x400000);
+
+            for (int i = 0; i < 100; i++) {
+                if (process->file[i] != NULL) {
+                    close_file(process, i);
                 }
-                memset(process, 0, sizeof(struct Process));
-                break;
-            }   
+            }
+            free_process(process);
+            break;
         }
-       
+
         sleep(-3);     
     }
 }
@@ -345,6 +487,11 @@ int fork(void)
         return -1;
     }
 
+    if (copy_vm_areas(process, current_process) == false) {
+        ASSERT(0);
+        return -1;
+    }
+
     memcpy(process->file, current_process->file, 100 * sizeof(struct FileDesc*));
 
     for (int i = 0; i < 100; i++) {
@@ -370,54 +517,44 @@ int fork(void)
 int exec(struct Process *process, char* name)
 {
     int fd;
-    uint32_t size;
-    void *buf;
 
     fd = open_file(process, name);
     if (fd == -1)
         exit();
 
-    size = get_file_size(process, fd);
-    buf = kmalloc(size);
-    if (!buf) {
+    if (!check_elf(process, fd)) {
         close_file(process, fd);
-        exit();
-    }
-
-    if (read_file(process, fd, buf, size) != size) {
-        kmfree(buf);
-        close_file(process, fd);
-        exit();
+        return -1;
     }
 
-    close_file(process, fd);
-
     memset(process->tf, 0, sizeof(struct TrapFrame));
     process->tf->cs = 0x10|3;
     process->tf->ss = 0x18|3;
     process->tf->rflags = 0x202;
 
-    if (!load_elf(process, buf)) {
-        kmfree(buf);
+    free_vm_areas(process);
+
+    if (!load_elf(process, fd)) {
+        close_file(process, fd);
         exit();
     }
 
-    kmfree(buf);
+    close_file(process, fd);
     return 0;
 }
 
 int grow_process(struct Process *process, int64_t inc)
 {
     if (inc > 0) {
+        if (process->brk + inc > MMAP_BASE)
+            return -1;
         process->brk += inc;
     } else if (inc < 0) {
         uint64_t dec = -inc;
         if (dec > process->brk - 0x400000)
             dec = process->brk - 0x400000;
         uint64_t new_brk = process->brk - dec;
-        for (uint64_t addr = PA_UP(new_brk); addr < PA_UP(process->brk); addr += PAGE_SIZE) {
-            free_pages(process->page_map, addr, addr + PAGE_SIZE);
-        }
+        free_pages(process->page_map, SPA_UP(new_brk), PA_UP(process->brk));
         process->brk = new_brk;
     }
 
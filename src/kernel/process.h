@@ -5,6 +5,8 @@
 #include "lib.h"
 #include "file.h"
 
+struct VmArea;
+
 struct Process {
         struct List *next;
     int pid;
@@ -20,6 +22,13 @@ struct Process {
         uint64_t stack;
         struct TrapFrame *tf;
         uint64_t brk;
+        struct VmArea *vm_areas;
+        /* page faults served from memory, and those which copied a
+           shared page, gave out zero fill or left the swap store */
+        uint64_t minor_faults;
+        uint64_t cow_faults;
+        uint64_t zero_faults;
+        uint64_t swap_faults;
 };
 
 struct TSS {
@@ -47,18 +56,37 @@ struct SchedInfo {
     int time_slice;
 };
 
+/* what get_proc_stats reports for each process, libc keeps the same layout */
+struct ProcStats {
+    int32_t pid;
+    int32_t state;
+    uint64_t runtime;
+    uint64_t brk;
+    /* in 4KB pages */
+    uint64_t resident_pages;
+    uint64_t shared_pages;
+    uint64_t swapped_pages;
+    uint64_t table_pages;
+    uint64_t minor_faults;
+    uint64_t cow_faults;
+    uint64_t zero_faults;
+    uint64_t swap_faults;
+    /* deepest use of the kernel stack so far, in bytes */
+    uint64_t stack_used;
+};
+
 
 #define MAX_PRIORITY 4
 
 struct ProcessControl {
     struct Process *current_process;
+    struct Process *idle_process;
     struct HeadList ready_list[MAX_PRIORITY];
     struct HeadList wait_list;
     struct HeadList kill_list;
     int need_resched;
 };
 
-#define STACK_SIZE (2*1024*1024)
 #define NUM_PROC 10
 #define PROC_UNUSED 0
 #define PROC_INIT 1
@@ -70,7 +98,11 @@ struct ProcessControl {
 void set_process_priority(struct Process *proc, int priority);
 
 void init_process(void);
+void idle(void);
+struct Process* create_idle_process(int cpu);
 struct ProcessControl* get_pc(void);
+struct Process* get_process(int index);
+int get_proc_stats(struct ProcStats *stats, int count);
 void yield(void);
 void swap(uint64_t *prev, uint64_t next);
 void sleep(int wait);
@@ -0,0 +1,303 @@
+#include "slab.h"
+#include "memory.h"
+#include "cpu.h"
+#include "lib.h"
+#include "print.h"
+#include "debug.h"
+#include "memtrace.h"
+
+/*
+ * Objects are carved out of slabs, blocks of SLAB_SIZE bytes aligned to
+ * their own size, so the slab header of any object is found by masking
+ * its address. Each cache keeps a small stack of free objects per CPU
+ * and only takes the cache lock to move a batch between that stack and
+ * its slabs.
+ */
+
+#define SLAB_ORDER 2
+#define SLAB_SIZE (SMALL_PAGE_SIZE << SLAB_ORDER)
+#define SLAB_DOWN(v) ((uint64_t)(v) & ~(uint64_t)(SLAB_SIZE - 1))
+#define SLAB_HEADER_SIZE ((sizeof(struct Slab) + 15) & ~15ULL)
+
+#define MAX_CACHES 32
+#define CPU_OBJECTS 16
+#define CPU_BATCH (CPU_OBJECTS / 2)
+
+#define KMALLOC_MIN_SHIFT 4
+#define KMALLOC_MAX_SHIFT 11
+#define KMALLOC_CLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+struct Slab {
+    struct Slab *next;
+    struct Slab *prev;
+    struct KmemCache *cache;
+    void *free;
+    int inuse;
+};
+
+struct KmemCpuCache {
+    int count;
+    void *objects[CPU_OBJECTS];
+    uint64_t allocs;
+    uint64_t frees;
+};
+
+struct KmemCache {
+    char name[16];
+    size_t size;
+    int capacity;
+    struct Slab partial;
+    struct Slab full;
+    uint64_t slabs;
+    struct SpinLock lock;
+    struct KmemCpuCache cpu[MAX_CPU];
+};
+
+static struct KmemCache caches[MAX_CACHES];
+static int cache_count;
+static struct KmemCache *kmalloc_caches[KMALLOC_CLASSES];
+
+static void list_init(struct Slab *head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_add(struct Slab *head, struct Slab *slab)
+{
+    slab->next = head->next;
+    slab->prev = head;
+    head->next->prev = slab;
+    head->next = slab;
+}
+
+static void list_del(struct Slab *slab)
+{
+    slab->prev->next = slab->next;
+    slab->next->prev = slab->prev;
+}
+
+struct KmemCache* kmem_cache_create(const char *name, size_t size)
+{
+    struct KmemCache *cache;
+
+    ASSERT(cache_count < MAX_CACHES);
+    cache = &caches[cache_count++];
+    memset(cache, 0, sizeof(struct KmemCache));
+
+    for (int i = 0; i < (int)sizeof(cache->name) - 1 && name[i] != '\0'; i++)
+        cache->name[i] = name[i];
+
+    cache->size = (size + 15) & ~15ULL;
+    cache->capacity = (SLAB_SIZE - SLAB_HEADER_SIZE) / cache->size;
+    ASSERT(cache->capacity > 0);
+
+    list_init(&cache->partial);
+    list_init(&cache->full);
+
+    return cache;
+}
+
+static struct Slab* new_slab(struct KmemCache *cache)
+{
+    struct Slab *slab = kalloc_pages(SLAB_ORDER);
+    if (slab == NULL)
+        return NULL;
+
+    page_setflags(V2P(slab), FRAME_SLAB);
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free = NULL;
+
+    char *obj = (char*)slab + SLAB_HEADER_SIZE + (cache->capacity - 1) * cache->size;
+    for (int i = 0; i < cache->capacity; i++, obj -= cache->size) {
+        *(void**)obj = slab->free;
+        slab->free = obj;
+    }
+
+    cache->slabs++;
+    list_add(&cache->partial, slab);
+
+    return slab;
+}
+
+static void* slab_alloc_object(struct KmemCache *cache)
+{
+    struct Slab *slab = cache->partial.next;
+
+    if (slab == &cache->partial) {
+        slab = new_slab(cache);
+        if (slab == NULL)
+            return NULL;
+    }
+
+    void *obj = slab->free;
+    slab->free = *(void**)obj;
+    slab->inuse++;
+
+    if (slab->free == NULL) {
+        list_del(slab);
+        list_add(&cache->full, slab);
+    }
+
+    return obj;
+}
+
+static void slab_free_object(struct KmemCache *cache, void *obj)
+{
+    struct Slab *slab = (struct Slab*)SLAB_DOWN(obj);
+
+    ASSERT(slab->cache == cache);
+
+    if (slab->free == NULL) {
+        list_del(slab);
+        list_add(&cache->partial, slab);
+    }
+
+    *(void**)obj = slab->free;
+    slab->free = obj;
+    slab->inuse--;
+
+    /* keep one slab around so a single object does not bounce pages */
+    if (slab->inuse == 0 && cache->slabs > 1) {
+        list_del(slab);
+        cache->slabs--;
+        page_setflags(V2P(slab), 0);
+        kfree((uint64_t)slab);
+    }
+}
+
+void* kmem_cache_alloc(struct KmemCache *cache)
+{
+    struct KmemCpuCache *cpu = &cache->cpu[cpu_id()];
+
+    if (cpu->count == 0) {
+        spin_lock(&cache->lock);
+        while (cpu->count < CPU_BATCH) {
+            void *obj = slab_alloc_object(cache);
+            if (obj == NULL)
+                break;
+            cpu->objects[cpu->count++] = obj;
+        }
+        spin_unlock(&cache->lock);
+
+        if (cpu->count == 0)
+            return NULL;
+    }
+
+    cpu->allocs++;
+    return cpu->objects[--cpu->count];
+}
+
+void kmem_cache_free(struct KmemCache *cache, void *obj)
+{
+    struct KmemCpuCache *cpu = &cache->cpu[cpu_id()];
+
+    if (obj == NULL)
+        return;
+
+    if (cpu->count == CPU_OBJECTS) {
+        spin_lock(&cache->lock);
+        while (cpu->count > CPU_BATCH)
+            slab_free_object(cache, cpu->objects[--cpu->count]);
+        spin_unlock(&cache->lock);
+    }
+
+    cpu->frees++;
+    cpu->objects[cpu->count++] = obj;
+}
+
+bool get_kmem_cache_info(int index, struct KmemCacheInfo *info)
+{
+    if (index < 0 || index >= cache_count)
+        return false;
+
+    struct KmemCache *cache = &caches[index];
+    uint64_t allocs = 0;
+    uint64_t frees = 0;
+
+    for (int i = 0; i < MAX_CPU; i++) {
+        allocs += cache->cpu[i].allocs;
+        frees += cache->cpu[i].frees;
+    }
+
+    memset(info, 0, sizeof(struct KmemCacheInfo));
+    memcpy(info->name, cache->name, sizeof(info->name));
+    info->object_size = cache->size;
+    info->slabs = cache->slabs;
+    info->total_objects = cache->slabs * cache->capacity;
+    info->active_objects = allocs - frees;
+
+    return true;
+}
+
+void print_kmem_caches(void)
+{
+    struct KmemCacheInfo info;
+
+    printk("cache  size  slabs  objects  active  used\n");
+    for (int i = 0; get_kmem_cache_info(i, &info); i++) {
+        uint64_t used = 0;
+        if (info.slabs != 0)
+            used = info.active_objects * info.object_size * 100 / (info.slabs * SLAB_SIZE);
+        printk("%s  %u  %u  %u  %u  %u\n", info.name, info.object_size, info.slabs,
+               info.total_objects, info.active_objects, used);
+    }
+}
+
+void init_kheap(void)
+{
+    static const char *names[KMALLOC_CLASSES] = {
+        "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+        "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+    };
+
+    for (int i = 0; i < KMALLOC_CLASSES; i++)
+        kmalloc_caches[i] = kmem_cache_create(names[i], 1ULL << (i + KMALLOC_MIN_SHIFT));
+}
+
+/*
+ * Requests up to 2KB come from the size classes above. Anything larger
+ * is a physically contiguous block straight from the page allocator.
+ */
+static void *alloc_object(size_t size)
+{
+    if (size <= (1ULL << KMALLOC_MAX_SHIFT)) {
+        int index = 0;
+        while ((1ULL << (index + KMALLOC_MIN_SHIFT)) < size)
+            index++;
+        return kmem_cache_alloc(kmalloc_caches[index]);
+    }
+
+    int order = 0;
+    while (order <= MAX_ORDER && (SMALL_PAGE_SIZE << order) < size)
+        order++;
+    if (order > MAX_ORDER)
+        return NULL;
+
+    return kalloc_pages(order);
+}
+
+void *kmalloc(size_t size)
+{
+    void *ptr = alloc_object(size);
+
+    trace_alloc(ptr, size, __builtin_return_address(0));
+    return ptr;
+}
+
+void kmfree(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    trace_free(ptr);
+
+    if (page_getflags(V2P(SLAB_DOWN(ptr))) & FRAME_SLAB) {
+        struct Slab *slab = (struct Slab*)SLAB_DOWN(ptr);
+        kmem_cache_free(slab->cache, ptr);
+        return;
+    }
+
+    kfree((uint64_t)ptr);
+}
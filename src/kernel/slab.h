@@ -0,0 +1,24 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include "stdint.h"
+#include "stddef.h"
+#include "stdbool.h"
+
+struct KmemCache;
+
+struct KmemCacheInfo {
+    char name[16];
+    uint64_t object_size;
+    uint64_t slabs;
+    uint64_t total_objects;
+    uint64_t active_objects;
+};
+
+struct KmemCache* kmem_cache_create(const char *name, size_t size);
+void* kmem_cache_alloc(struct KmemCache *cache);
+void kmem_cache_free(struct KmemCache *cache, void *obj);
+bool get_kmem_cache_info(int index, struct KmemCacheInfo *info);
+void print_kmem_caches(void);
+
+#endif
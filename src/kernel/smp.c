@@ -0,0 +1,189 @@
+#include "smp.h"
+#include "cpu.h"
+#include "memory.h"
+#include "process.h"
+#include "trap.h"
+#include "kstack.h"
+#include "print.h"
+#include "lib.h"
+
+/*
+ * Application processors. Each AP gets an INIT and a startup IPI which
+ * points it at a copy of ap_trampoline below 1MB. The trampoline runs
+ * on page tables of its own, which share the kernel half with every map
+ * and map the first 2MB one to one, and calls ap_main on the stack of
+ * the idle process of the CPU. start_aps waits for an AP to check in
+ * before it starts the next one.
+ *
+ * CPU n is assumed to have local APIC ID n.
+ */
+
+#define LAPIC_EOI 0xb0
+#define LAPIC_SVR 0xf0
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310
+
+#define SVR_ENABLE 0x100
+#define ICR_PENDING (1 << 12)
+#define ICR_FIXED 0x4000
+#define ICR_INIT 0x4500
+#define ICR_STARTUP 0x4600
+
+/* unused memory below 1MB, the boot code is done with it */
+#define TRAMPOLINE_BASE 0x8000
+#define TRAMPOLINE_PML4 0x9000
+#define TRAMPOLINE_PDPT 0xa000
+#define TRAMPOLINE_PD 0xb000
+
+#define PIT_HZ 1193182
+#define PIT_RELOAD 11931
+
+/* filled in for each AP, the layout matches smp.asm */
+struct TrampolineArgs {
+    uint32_t cr3;
+    uint32_t cpu;
+    uint64_t stack;
+    uint64_t entry;
+};
+
+extern char ap_trampoline[];
+extern char ap_trampoline_args[];
+extern char ap_trampoline_end[];
+
+static volatile uint32_t* lapic_reg(uint32_t reg)
+{
+    return (volatile uint32_t*)P2V(LAPIC_BASE + reg);
+}
+
+static void write_icr(int cpu, uint32_t command)
+{
+    *lapic_reg(LAPIC_ICR_HIGH) = (uint32_t)cpu << 24;
+    *lapic_reg(LAPIC_ICR_LOW) = command;
+
+    while (*lapic_reg(LAPIC_ICR_LOW) & ICR_PENDING)
+        __asm__ volatile("pause");
+}
+
+void send_ipi(int cpu, unsigned char vector)
+{
+    write_icr(cpu, ICR_FIXED | vector);
+}
+
+void lapic_eoi(void)
+{
+    *lapic_reg(LAPIC_EOI) = 0;
+}
+
+/* a local APIC only accepts IPIs once it is enabled */
+void init_lapic(void)
+{
+    *lapic_reg(LAPIC_SVR) = SVR_ENABLE | SPURIOUS_VECTOR;
+}
+
+static uint16_t read_pit(void)
+{
+    uint8_t low, high;
+
+    __asm__ volatile("outb %0, $0x43" : : "a"((uint8_t)0));
+    __asm__ volatile("inb $0x40, %0" : "=a"(low));
+    __asm__ volatile("inb $0x40, %0" : "=a"(high));
+
+    return low | (high << 8);
+}
+
+/* interrupts are off while the APs start, so count down the PIT instead */
+static void delay_us(uint32_t us)
+{
+    uint64_t wait = (uint64_t)us * PIT_HZ / 1000000;
+    uint64_t elapsed = 0;
+    uint16_t last = read_pit();
+
+    while (elapsed < wait) {
+        uint16_t now = read_pit();
+
+        elapsed += (now <= last) ? last - now : last + PIT_RELOAD - now;
+        last = now;
+    }
+}
+
+static bool wait_online(int id, uint32_t us)
+{
+    for (uint32_t t = 0; t < us; t += 100) {
+        if (*(volatile int*)&cpus[id].online)
+            return true;
+        delay_us(100);
+    }
+
+    return *(volatile int*)&cpus[id].online != 0;
+}
+
+static void init_trampoline(void)
+{
+    uint64_t *pml4 = (uint64_t*)P2V(TRAMPOLINE_PML4);
+    uint64_t *pdpt = (uint64_t*)P2V(TRAMPOLINE_PDPT);
+    uint64_t *pd = (uint64_t*)P2V(TRAMPOLINE_PD);
+
+    memcpy((void*)P2V(TRAMPOLINE_BASE), ap_trampoline, ap_trampoline_end - ap_trampoline);
+
+    memcpy(pml4, (void*)get_kernel_map(), SMALL_PAGE_SIZE);
+    memset(pdpt, 0, SMALL_PAGE_SIZE);
+    memset(pd, 0, SMALL_PAGE_SIZE);
+    pml4[0] = TRAMPOLINE_PDPT | PTE_P | PTE_W;
+    pdpt[0] = TRAMPOLINE_PD | PTE_P | PTE_W;
+    pd[0] = PTE_P | PTE_W | PTE_ENTRY;
+}
+
+/*
+ * Start the APs one at a time. An AP which does not check in might
+ * still pick up the arguments later, so no further AP is started.
+ */
+void start_aps(void)
+{
+    struct TrampolineArgs *args = (struct TrampolineArgs*)
+        P2V(TRAMPOLINE_BASE + (ap_trampoline_args - ap_trampoline));
+
+    init_lapic();
+    if (cpu_count == 1)
+        return;
+
+    init_trampoline();
+
+    for (int id = 1; id < cpu_count; id++) {
+        struct Process *idle = create_idle_process(id);
+
+        if (idle == NULL)
+            break;
+
+        args->cr3 = TRAMPOLINE_PML4;
+        args->cpu = id;
+        args->stack = idle->stack + KSTACK_SIZE;
+        args->entry = (uint64_t)ap_main;
+        __sync_synchronize();
+
+        write_icr(id, ICR_INIT);
+        delay_us(10000);
+        write_icr(id, ICR_STARTUP | (TRAMPOLINE_BASE >> 12));
+        if (!wait_online(id, 200))
+            write_icr(id, ICR_STARTUP | (TRAMPOLINE_BASE >> 12));
+
+        if (!wait_online(id, 100000)) {
+            printk("cpu %d did not start\n", id);
+            break;
+        }
+    }
+
+    printk("%d CPUs online\n", cpu_online_count);
+}
+
+/* the trampoline calls this on the stack of the idle process of the CPU */
+void ap_main(int id)
+{
+    init_cpu_local(id);
+    load_idt_table();
+    init_cpu_paging();
+    init_lapic();
+    cpu_mark_online(id);
+
+    lock_kernel();
+    idle();
+}
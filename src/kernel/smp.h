@@ -0,0 +1,19 @@
+#ifndef _SMP_H_
+#define _SMP_H_
+
+#include "stdint.h"
+
+#define LAPIC_BASE 0xfee00000
+
+/* interrupts the local APICs deliver */
+#define RESCHEDULE_VECTOR 40
+#define TLB_VECTOR 41
+#define SPURIOUS_VECTOR 0xff
+
+void init_lapic(void);
+void lapic_eoi(void);
+void send_ipi(int cpu, unsigned char vector);
+void start_aps(void);
+void ap_main(int id);
+
+#endif
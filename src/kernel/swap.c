@@ -0,0 +1,527 @@
+#include "swap.h"
+#include "memory.h"
+#include "process.h"
+#include "mmap.h"
+#include "cpu.h"
+#include "lib.h"
+#include "debug.h"
+
+/*
+ * When memory runs short, cold anonymous pages of processes which are
+ * not running are compressed into a store in kernel memory. The PTE of
+ * such a page is not present. It carries PTE_SWAP plus the store page
+ * and slot of the compressed copy, and the first touch brings the page
+ * back.
+ *
+ * Reclaim is a clock over the page tables of all processes. A page
+ * which was accessed since the last pass loses its accessed bit and
+ * stays. A page which was not is evicted. The hand is where the last
+ * scan stopped. The kernel does not preempt itself, so the tables of a
+ * process which is not running stay put while they are scanned. Page
+ * tables shared since fork are left alone.
+ *
+ * A store page holds slots of one size, a multiple of STORE_UNIT, after
+ * its header. An object starts with its compressed length and a
+ * reference count, since fork can copy a swap entry. A page which does
+ * not compress to less than half a page is not evicted.
+ */
+
+#define STORE_UNIT 128
+#define STORE_HEADER 64
+#define STORE_CLASSES ((SMALL_PAGE_SIZE - STORE_HEADER) / 2 / STORE_UNIT)
+#define STORE_MAX (STORE_CLASSES * STORE_UNIT)
+
+/* a swap entry: store page, slot in bits 52-56 and PTE_SWAP */
+#define SWAP_PAGE(e) ((e) & 0x000ffffffffff000ULL)
+#define SWAP_SLOT(e) ((int)(((e) >> 52) & 0x1f))
+#define SWAP_ENTRY(pa, slot) ((pa) | ((uint64_t)(slot) << 52) | PTE_SWAP)
+
+/* start evicting in the idle loop below this share of memory free */
+#define SWAP_LOW_RATIO 64
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_HASH_BITS 12
+/* the format ends with literals, a match may not start in the last
+   12 bytes nor reach into the last 5 */
+#define LZ4_MATCH_LIMIT 12
+#define LZ4_LAST_LITERALS 5
+
+struct StorePage {
+    struct StorePage *next;
+    struct StorePage *prev;
+    int size;
+    int slots;
+    int used;
+    /* bit n set: slot n is free */
+    uint32_t free;
+};
+
+struct StoreObject {
+    uint16_t length;
+    uint16_t ref;
+    uint8_t data[];
+};
+
+struct ReclaimScan {
+    uint64_t map;
+    int target;
+    int freed;
+    /* where the scan ran out of target */
+    uint64_t next;
+};
+
+static struct StorePage *partial_pages[STORE_CLASSES + 1];
+static struct SpinLock swap_lock;
+static struct SwapInfo swap_info;
+static uint16_t hash_table[1 << LZ4_HASH_BITS];
+static uint8_t swap_buffer[STORE_MAX];
+static int clock_process;
+static uint64_t clock_va;
+static bool reclaiming;
+
+static uint32_t read32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint8_t* put_length(uint8_t *op, int length)
+{
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = length;
+
+    return op;
+}
+
+/* one LZ4 sequence: literals from anchor, then a match unless length is 0 */
+static uint8_t* put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *anchor, int literals,
+                             int offset, int length)
+{
+    /* token, length bytes, literals and offset */
+    if (op + 1 + literals / 255 + 1 + literals + 2 + length / 255 + 1 > oend)
+        return NULL;
+
+    uint8_t *token = op++;
+
+    *token = (literals < 15 ? literals : 15) << 4;
+    if (literals >= 15)
+        op = put_length(op, literals - 15);
+    for (int i = 0; i < literals; i++)
+        *op++ = anchor[i];
+
+    if (length == 0)
+        return op;
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+
+    length -= LZ4_MIN_MATCH;
+    *token |= length < 15 ? length : 15;
+    if (length >= 15)
+        op = put_length(op, length - 15);
+
+    return op;
+}
+
+/* compress a page into the LZ4 block format, -1 if it needs more than capacity */
+static int lz4_compress(const uint8_t *src, int size, uint8_t *dst, int capacity)
+{
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *iend = src + size;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + capacity;
+
+    memset(hash_table, 0, sizeof(hash_table));
+
+    while (ip + LZ4_MATCH_LIMIT <= iend) {
+        uint32_t sequence = read32(ip);
+        uint32_t hash = (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+        const uint8_t *ref = src + hash_table[hash];
+
+        hash_table[hash] = ip - src;
+        if (ref >= ip || read32(ref) != sequence) {
+            ip++;
+            continue;
+        }
+
+        int length = LZ4_MIN_MATCH;
+        while (ip + length < iend - LZ4_LAST_LITERALS && ref[length] == ip[length])
+            length++;
+
+        op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, length);
+        if (op == NULL)
+            return -1;
+
+        ip += length;
+        anchor = ip;
+    }
+
+    op = put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    if (op == NULL)
+        return -1;
+
+    return op - dst;
+}
+
+static bool get_length(const uint8_t **ip, const uint8_t *iend, int *length)
+{
+    uint8_t byte;
+
+    do {
+        if (*ip >= iend)
+            return false;
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+/* true if src decompresses to exactly size bytes */
+static bool lz4_decompress(const uint8_t *src, int length, uint8_t *dst, int size)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + length;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + size;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        int literals = token >> 4;
+
+        if (literals == 15 && !get_length(&ip, iend, &literals))
+            return false;
+        if (literals > iend - ip || literals > oend - op)
+            return false;
+        for (int i = 0; i < literals; i++)
+            *op++ = *ip++;
+
+        /* the last sequence has no match */
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return false;
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - dst)
+            return false;
+
+        int match = token & 15;
+        if (match == 15 && !get_length(&ip, iend, &match))
+            return false;
+        match += LZ4_MIN_MATCH;
+        if (match > oend - op)
+            return false;
+
+        /* the match may overlap what it produces */
+        const uint8_t *ref = op - offset;
+        for (int i = 0; i < match; i++)
+            *op++ = *ref++;
+    }
+
+    return op == oend;
+}
+
+static struct StoreObject* get_object(uint64_t entry)
+{
+    struct StorePage *page = (struct StorePage*)P2V(SWAP_PAGE(entry));
+    uint8_t *slot = (uint8_t*)page + STORE_HEADER + SWAP_SLOT(entry) * page->size;
+
+    return (struct StoreObject*)slot;
+}
+
+static void link_store_page(struct StorePage *page)
+{
+    struct StorePage **head = &partial_pages[page->size / STORE_UNIT];
+
+    page->prev = NULL;
+    page->next = *head;
+    if (*head != NULL)
+        (*head)->prev = page;
+    *head = page;
+}
+
+static void unlink_store_page(struct StorePage *page)
+{
+    if (page->prev != NULL)
+        page->prev->next = page->next;
+    else
+        partial_pages[page->size / STORE_UNIT] = page->next;
+
+    if (page->next != NULL)
+        page->next->prev = page->prev;
+}
+
+/*
+ * A slot for length bytes of compressed data. When no store page has
+ * room and no page can be allocated, the evicted page itself at spare
+ * becomes the store page. new_pages counts the pages taken from the
+ * allocator.
+ */
+static uint64_t alloc_object(int length, uint64_t spare, int *new_pages, bool *used_spare)
+{
+    int units = (length + sizeof(struct StoreObject) + STORE_UNIT - 1) / STORE_UNIT;
+    struct StorePage *page = partial_pages[units];
+
+    if (page == NULL) {
+        page = kalloc();
+        if (page != NULL) {
+            (*new_pages)++;
+        }
+        else {
+            page = (struct StorePage*)P2V(spare);
+            *used_spare = true;
+        }
+
+        page->size = units * STORE_UNIT;
+        page->slots = (SMALL_PAGE_SIZE - STORE_HEADER) / page->size;
+        page->used = 0;
+        page->free = (1U << page->slots) - 1;
+        link_store_page(page);
+        swap_info.store_pages++;
+    }
+
+    int slot = __builtin_ctz(page->free);
+
+    page->free &= ~(1U << slot);
+    page->used++;
+    if (page->free == 0)
+        unlink_store_page(page);
+
+    return SWAP_ENTRY(V2P(page), slot);
+}
+
+static void put_object(uint64_t entry)
+{
+    struct StorePage *page = (struct StorePage*)P2V(SWAP_PAGE(entry));
+    struct StoreObject *object = get_object(entry);
+    int slot = SWAP_SLOT(entry);
+
+    ASSERT((page->free & (1U << slot)) == 0 && object->ref > 0);
+
+    if (--object->ref > 0)
+        return;
+
+    swap_info.stored_pages--;
+    swap_info.stored_bytes -= object->length;
+
+    if (page->free == 0)
+        link_store_page(page);
+    page->free |= 1U << slot;
+    page->used--;
+
+    if (page->used == 0) {
+        unlink_store_page(page);
+        swap_info.store_pages--;
+        kfree((uint64_t)page);
+    }
+}
+
+/*
+ * Move the page entry maps at va into the store. Returns the number of
+ * pages this freed, which is 0 if the page does not compress well or
+ * the store had to grow by a page to take it.
+ */
+static int swap_out(uint64_t map, uint64_t *entry, uint64_t va)
+{
+    uint64_t old = *entry;
+    uint64_t pa = PDE_ADDR(old);
+    int new_pages = 0;
+    bool used_spare = false;
+
+    spin_lock(&swap_lock);
+
+    int length = lz4_compress((uint8_t*)P2V(pa), SMALL_PAGE_SIZE, swap_buffer,
+                              STORE_MAX - sizeof(struct StoreObject));
+    if (length < 0) {
+        swap_info.rejected++;
+        spin_unlock(&swap_lock);
+        return 0;
+    }
+
+    /* the page may become a store page below */
+    *entry = 0;
+    tlb_shootdown(map, va, va + SMALL_PAGE_SIZE);
+
+    uint64_t swap = alloc_object(length, pa, &new_pages, &used_spare);
+    struct StoreObject *object = get_object(swap);
+
+    object->length = length;
+    object->ref = 1;
+    memcpy(object->data, swap_buffer, length);
+
+    swap_info.stored_pages++;
+    swap_info.stored_bytes += length;
+    swap_info.swap_outs++;
+    spin_unlock(&swap_lock);
+
+    *entry = swap | (old & (PTE_W|PTE_U));
+
+    if (used_spare)
+        return 0;
+
+    page_decref(pa);
+    return 1 - new_pages;
+}
+
+/* stop at table granularity, a table may be shared by the next scan */
+static int reclaim_table(uint64_t *entry, uint64_t va, void *arg)
+{
+    struct ReclaimScan *scan = arg;
+
+    if (scan->freed >= scan->target) {
+        scan->next = va;
+        return WALK_ABORT;
+    }
+
+    /* the pages behind a shared table are mapped in more than one map */
+    return (*entry & PTE_SHARED) ? WALK_SKIP : WALK_DESCEND;
+}
+
+static bool reclaim_leaf(uint64_t *entry, uint64_t va, uint64_t size, void *arg)
+{
+    struct ReclaimScan *scan = arg;
+    uint64_t pa = PDE_ADDR(*entry);
+
+    if (scan->freed >= scan->target) {
+        scan->next = PA_DOWN(va);
+        return false;
+    }
+
+    /* only private 4KB pages, not the zero page or the FS image */
+    if (size != SMALL_PAGE_SIZE || page_getref(pa) != 1 || page_getflags(pa) != 0)
+        return true;
+
+    if (*entry & PTE_A) {
+        *entry &= ~PTE_A;
+        return true;
+    }
+
+    scan->freed += swap_out(scan->map, entry, va);
+    return true;
+}
+
+/* evict cold pages until target pages are free, returns how many were freed */
+int reclaim_pages(int target)
+{
+    int freed = 0;
+
+    /* the store allocates while reclaiming, which must not recurse */
+    if (reclaiming)
+        return 0;
+    reclaiming = true;
+
+    /* each process twice, the first pass may only clear accessed bits */
+    for (int i = 0; i <= 2 * NUM_PROC && freed < target; i++) {
+        struct Process *proc = get_process(clock_process);
+
+        if (proc != NULL && proc->pid != 0 &&
+            (proc->state == PROC_READY || proc->state == PROC_SLEEP)) {
+            struct ReclaimScan scan = { proc->page_map, target - freed, 0, MMAP_END };
+            struct PageWalk walk = { proc->page_map, 0, reclaim_leaf, reclaim_table, &scan };
+
+            walk_page_tables(&walk, clock_va, MMAP_END);
+            freed += scan.freed;
+
+            if (scan.next < MMAP_END) {
+                clock_va = scan.next;
+                break;
+            }
+        }
+
+        clock_process = (clock_process + 1) % NUM_PROC;
+        clock_va = 0;
+    }
+
+    reclaiming = false;
+    return freed;
+}
+
+/* keep some memory free ahead of the allocations which need it */
+bool reclaim_idle_memory(void)
+{
+    uint64_t low = get_total_memory() * (1024 * 1024 / SMALL_PAGE_SIZE) / SWAP_LOW_RATIO;
+
+    if (get_free_pages() >= low)
+        return false;
+
+    return reclaim_pages(RECLAIM_BATCH) > 0;
+}
+
+/* decompress the page of a swap entry without giving up the entry */
+bool swap_read(uint64_t entry, void *page)
+{
+    struct StoreObject *object;
+    bool status;
+
+    spin_lock(&swap_lock);
+    object = get_object(entry);
+    status = lz4_decompress(object->data, object->length, page, SMALL_PAGE_SIZE);
+    spin_unlock(&swap_lock);
+
+    return status;
+}
+
+/* replace the swap entry with a fresh copy of its page */
+bool swap_in_entry(uint64_t *entry)
+{
+    uint64_t old = *entry;
+    void *page = kalloc();
+
+    if (page == NULL)
+        return false;
+
+    if (!swap_read(old, page)) {
+        kfree((uint64_t)page);
+        return false;
+    }
+
+    spin_lock(&swap_lock);
+    put_object(old);
+    swap_info.swap_ins++;
+    spin_unlock(&swap_lock);
+
+    *entry = V2P(page) | PTE_P | (old & (PTE_W|PTE_U));
+    return true;
+}
+
+/* 1 if va was swapped out and is back, 0 if it was not swapped out */
+int swap_in_page(uint64_t map, uint64_t va)
+{
+    PT pt = find_pdt_entry(map, va, 0, 0);
+    uint64_t *entry;
+
+    if (pt == NULL)
+        return 0;
+
+    entry = &pt[(va >> 12) & 0x1FF];
+    if ((*entry & PTE_P) || (*entry & PTE_SWAP) == 0)
+        return 0;
+
+    return swap_in_entry(entry) ? 1 : -1;
+}
+
+void swap_dup(uint64_t entry)
+{
+    spin_lock(&swap_lock);
+    get_object(entry)->ref++;
+    spin_unlock(&swap_lock);
+}
+
+void swap_free(uint64_t entry)
+{
+    spin_lock(&swap_lock);
+    put_object(entry);
+    spin_unlock(&swap_lock);
+}
+
+void get_swap_info(struct SwapInfo *info)
+{
+    spin_lock(&swap_lock);
+    memcpy(info, &swap_info, sizeof(struct SwapInfo));
+    spin_unlock(&swap_lock);
+}
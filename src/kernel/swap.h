@@ -0,0 +1,28 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+#include "stdint.h"
+#include "stdbool.h"
+
+/* pages reclaimed at once when an allocation fails */
+#define RECLAIM_BATCH 16
+
+struct SwapInfo {
+    uint64_t stored_pages;
+    uint64_t store_pages;
+    uint64_t stored_bytes;
+    uint64_t swap_outs;
+    uint64_t swap_ins;
+    uint64_t rejected;
+};
+
+int reclaim_pages(int target);
+bool reclaim_idle_memory(void);
+int swap_in_page(uint64_t map, uint64_t va);
+bool swap_in_entry(uint64_t *entry);
+bool swap_read(uint64_t entry, void *page);
+void swap_dup(uint64_t entry);
+void swap_free(uint64_t entry);
+void get_swap_info(struct SwapInfo *info);
+
+#endif
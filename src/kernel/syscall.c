@@ -6,9 +6,13 @@
 #include "debug.h"
 #include "stddef.h"
 #include "file.h"
+#include "mmap.h"
 #include "net/socket.h"
+#include "ksm.h"
+#include "slab.h"
+#include "memtrace.h"
 
-static SYSTEMCALL system_calls[28];
+static SYSTEMCALL system_calls[36];
 
 static int sys_sbrk(int64_t *argptr)
 {
@@ -195,6 +199,73 @@ static int sys_recvfrom(int64_t *argptr)
     return socket_recv((int)argptr[0], (void*)argptr[1], (int)argptr[2]);
 }
 
+static int sys_mmap(int64_t *argptr)
+{
+    struct ProcessControl *pc = get_pc();
+    return mmap_file(pc->current_process, (int)argptr[0], (uint32_t)argptr[1],
+                     (uint32_t)argptr[2], (int)argptr[3]);
+}
+
+static int sys_munmap(int64_t *argptr)
+{
+    struct ProcessControl *pc = get_pc();
+    return munmap_range(pc->current_process, (uint64_t)argptr[0], (uint32_t)argptr[1]);
+}
+
+static int sys_madvise(int64_t *argptr)
+{
+    struct ProcessControl *pc = get_pc();
+    return madvise_range(pc->current_process, (uint64_t)argptr[0], (uint64_t)argptr[1],
+                         (int)argptr[2]);
+}
+
+static int sys_get_numa_info(int64_t *argptr)
+{
+    struct ProcessControl *pc = get_pc();
+    get_numa_info(pc->current_process->page_map, (struct NumaInfo*)argptr[0]);
+    return 0;
+}
+
+static int sys_get_merge_info(int64_t *argptr)
+{
+    get_merge_info((struct MergeInfo*)argptr[0]);
+    return 0;
+}
+
+static int sys_get_mem_stats(int64_t *argptr)
+{
+    get_mem_stats((struct MemStats*)argptr[0]);
+    return 0;
+}
+
+static int sys_get_proc_stats(int64_t *argptr)
+{
+    return get_proc_stats((struct ProcStats*)argptr[0], (int)argptr[1]);
+}
+
+/* a dump goes to the console and tells whether tracing is on */
+static int sys_alloc_trace(int64_t *argptr)
+{
+    int command = (int)argptr[0];
+
+    if (command == TRACE_START)
+        return start_alloc_trace() ? 0 : -1;
+
+    if (command == TRACE_STOP) {
+        stop_alloc_trace();
+        return 0;
+    }
+
+    if (command == TRACE_DUMP) {
+        print_alloc_trace();
+        print_page_fragmentation();
+        print_kmem_caches();
+        return is_alloc_tracing() ? 1 : 0;
+    }
+
+    return -1;
+}
+
 void init_system_call(void)
 {
     system_calls[0] = sys_write;
@@ -225,6 +296,14 @@ void init_system_call(void)
     system_calls[25] = sys_readdir;
     system_calls[26] = sys_rmdir;
     system_calls[27] = sys_get_sched_info;
+    system_calls[28] = sys_mmap;
+    system_calls[29] = sys_munmap;
+    system_calls[30] = sys_madvise;
+    system_calls[31] = sys_get_numa_info;
+    system_calls[32] = sys_get_merge_info;
+    system_calls[33] = sys_get_mem_stats;
+    system_calls[34] = sys_get_proc_stats;
+    system_calls[35] = sys_alloc_trace;
 }
 
 void system_call(struct TrapFrame *tf)
@@ -233,7 +312,7 @@ void system_call(struct TrapFrame *tf)
     int64_t param_count = tf->rdi;
     int64_t *argptr = (int64_t*)tf->rsi;
 
-    if (param_count < 0 || i > 27 || i < 0) {
+    if (param_count < 0 || i > 35 || i < 0) {
         tf->rax = -1;
         return;
     }
@@ -5,6 +5,11 @@
 #include "keyboard.h"
 #include "debug.h"
 #include "memory.h"
+#include "cpu.h"
+#include "mmap.h"
+#include "swap.h"
+#include "ksm.h"
+#include "smp.h"
 
 static struct IdtPtr idt_pointer;
 static struct IdtEntry vectors[256];
@@ -32,6 +37,7 @@ void init_idt(void)
     init_idt_entry(&vectors[6],(uint64_t)vector6,0x8e);
     init_idt_entry(&vectors[7],(uint64_t)vector7,0x8e);
     init_idt_entry(&vectors[8],(uint64_t)vector8,0x8e);
+    vectors[8].ist = 1;
     init_idt_entry(&vectors[10],(uint64_t)vector10,0x8e);
     init_idt_entry(&vectors[11],(uint64_t)vector11,0x8e);
     init_idt_entry(&vectors[12],(uint64_t)vector12,0x8e);
@@ -47,28 +53,43 @@ void init_idt(void)
     init_idt_entry(&vectors[40],(uint64_t)vector40,0x8e);
     init_idt_entry(&vectors[41],(uint64_t)vector41,0x8e);
     init_idt_entry(&vectors[0x80],(uint64_t)sysint,0xee);
+    init_idt_entry(&vectors[SPURIOUS_VECTOR],(uint64_t)vector255,0x8e);
 
     idt_pointer.limit = sizeof(vectors)-1;
     idt_pointer.addr = (uint64_t)vectors;
     load_idt(&idt_pointer);
 }
 
+/* all CPUs share the table, the APs only load it */
+void load_idt_table(void)
+{
+    load_idt(&idt_pointer);
+}
+
 uint64_t get_ticks(void)
 {
     return ticks;
 }
 
+/* only the boot CPU gets the timer, it keeps the time slices of all CPUs */
 static void timer_handler(void)
 {
     ticks++;
     boost_counter++;
-    struct ProcessControl *pc = get_pc();
-    struct Process *proc = pc->current_process;
-    if (proc->pid != 0) {
+    for (int i = 0; i < cpu_count; i++) {
+        struct ProcessControl *pc = &cpus[i].pc;
+        struct Process *proc = pc->current_process;
+
+        if (!cpus[i].online || proc->pid == 0)
+            continue;
+
         proc->runtime++;
         proc->time_slice--;
-        if (proc->time_slice <= 0)
+        if (proc->time_slice <= 0) {
             pc->need_resched = 1;
+            if (i != cpu_id())
+                send_ipi(i, RESCHEDULE_VECTOR);
+        }
     }
     if (boost_counter >= BOOST_INTERVAL) {
         boost_counter = 0;
@@ -80,41 +101,91 @@ static void timer_handler(void)
 static int handle_page_fault(struct TrapFrame *tf)
 {
     uint64_t addr = read_cr2();
-    struct ProcessControl *pc = get_pc();
-    struct Process *proc = pc->current_process;
+    struct Process *proc = cpu_current_process();
+    struct VmArea *area = find_vm_area(proc, addr);
+    uint64_t size;
+
+    if (addr >= MMAP_END)
+        return -1;
 
-    if (addr >= proc->brk)
-        grow_process(proc, addr + PAGE_SIZE - proc->brk);
+    /* a page in the compressed store comes back before anything else */
+    int swapped = swap_in_page(proc->page_map, addr);
+    if (swapped < 0)
+        return -1;
+    if (swapped > 0) {
+        proc->swap_faults++;
+        if (!(tf->errorcode & 2))
+            return 0;
+    } else {
+        proc->minor_faults++;
+    }
 
-    uint64_t va = PA_DOWN(addr);
-    PD pd = find_pdpt_entry(proc->page_map, va, 0, 0);
-    if (!pd)
+    if (area != NULL) {
+        if ((tf->errorcode & 2) && !(area->flags & VM_WRITE))
+            return -1;
+        if (find_page_entry(proc->page_map, addr, &size) == NULL)
+            return fault_vm_area(proc, area, addr, tf->errorcode & 2);
+    } else if (addr >= MMAP_BASE) {
         return -1;
-    unsigned int idx = (va >> 21) & 0x1FF;
+    } else if (addr >= proc->brk) {
+        grow_process(proc, SPA_UP(addr + 1) - proc->brk);
+    }
 
-    if (!(pd[idx] & PTE_P)) {
-        void *page = kalloc();
+    /* a page table still shared since fork is copied before any change */
+    if ((tf->errorcode & 2) && !unshare_page_tables(proc->page_map, addr))
+        return -1;
+
+    uint64_t *entry = find_page_entry(proc->page_map, addr, &size);
+
+    /* untouched memory reads as the zero page and is backed by a 4KB
+       page on the first write, a kernel write through a user pointer
+       included since CR0.WP is set */
+    if (entry == NULL) {
+        uint64_t va = SPA_DOWN(addr);
+
+        proc->zero_faults++;
+        if (!(tf->errorcode & 2))
+            return map_zero_page(proc->page_map, va) ? 0 : -1;
+
+        void *page = kalloc_zeroed();
         if (!page)
             return -1;
-        memset(page, 0, PAGE_SIZE);
-        if (!map_pages(proc->page_map, va, va + PAGE_SIZE, V2P(page), PTE_P|PTE_W|PTE_U)) {
+        if (!map_pages(proc->page_map, va, va + SMALL_PAGE_SIZE, V2P(page), PTE_P|PTE_W|PTE_U)) {
             kfree((uint64_t)page);
             return -1;
         }
         return 0;
     }
 
-    if ((tf->errorcode & 2) && !(pd[idx] & PTE_W)) {
-        uint64_t pa = PTE_ADDR(pd[idx]);
-        if (page_getref(pa) > 1) {
-            void *page = kalloc();
+    if (tf->errorcode & 2) {
+        uint64_t pa = PDE_ADDR(*entry);
+
+        /* only the page table was read-only */
+        if (*entry & PTE_W)
+            return 0;
+
+        if (page_getflags(pa) & FRAME_MERGED)
+            unmerge_page(pa);
+
+        /* pages of the FS image are never written in place */
+        if (page_getref(pa) > 1 || (page_getflags(pa) & FRAME_RESERVED)) {
+            void *page;
+            if (is_zero_page(pa)) {
+                page = kalloc_zeroed();
+            } else {
+                page = kalloc_pages(size == PAGE_SIZE ? PAGE_ORDER : 0);
+                if (page)
+                    memcpy(page, (void*)P2V(pa), size);
+            }
             if (!page)
                 return -1;
-            memcpy(page, (void*)P2V(pa), PAGE_SIZE);
+            proc->cow_faults++;
             page_decref(pa);
-            pd[idx] = (PDE)(V2P(page) | PTE_P|PTE_W|PTE_U|PTE_ENTRY);
+            *entry = V2P(page) | PTE_P|PTE_W|PTE_U;
+            if (size == PAGE_SIZE)
+                *entry |= PTE_ENTRY;
         } else {
-            pd[idx] |= PTE_W;
+            *entry |= PTE_W;
         }
         return 0;
     }
@@ -125,6 +196,11 @@ static int handle_page_fault(struct TrapFrame *tf)
 void handler(struct TrapFrame *tf)
 {
     unsigned char isr_value;
+    /* coming from user mode or from the halted idle loop */
+    bool locked = !holds_kernel_lock();
+
+    if (locked)
+        lock_kernel();
 
     switch (tf->trapno) {
         case 32:  
@@ -144,18 +220,23 @@ void handler(struct TrapFrame *tf)
             }
             break;
 
-        case 40:
-            eoi();
+        case RESCHEDULE_VECTOR:
+            lapic_eoi();
             break;
 
-        case 41:
-            invalidate_tlb();
-            eoi();
+        case TLB_VECTOR:
+            handle_tlb_request();
+            lapic_eoi();
+            break;
+
+        case SPURIOUS_VECTOR:
             break;
 
         case 14:
             if (handle_page_fault(tf) < 0) {
-                if ((tf->cs & 3) == 3)
+                /* a system call may also fault on a bad user pointer */
+                if ((tf->cs & 3) == 3 ||
+                    (read_cr2() < MMAP_END && cpu_current_process()->pid != 0))
                     exit();
                 else
                     while (1) {}
@@ -166,6 +247,11 @@ void handler(struct TrapFrame *tf)
             system_call(tf);
             break;
 
+        case 8:
+            /* most likely a kernel stack ran into the guard page below it */
+            printk("double fault at %x, rsp %x\n", tf->rip, tf->rsp);
+            while (1) { }
+
         default:
             if ((tf->cs & 3) == 3) {
                 printk("Exception is %d\n", tf->trapno);
@@ -177,8 +263,11 @@ void handler(struct TrapFrame *tf)
     }
 
     struct ProcessControl *pc = get_pc();
-    if ((tf->trapno == 32 && pc->need_resched) || tf->trapno == 40) {
+    if ((tf->trapno == 32 || tf->trapno == RESCHEDULE_VECTOR) && pc->need_resched) {
         pc->need_resched = 0;
         yield();
     }
+
+    if (locked)
+        unlock_kernel();
 }
@@ -6,7 +6,8 @@
 struct IdtEntry{
     uint16_t low;
     uint16_t selector;
-    uint8_t res0;
+    /* interrupt stack table slot, 0 stays on the current stack */
+    uint8_t ist;
     uint8_t attr;
     uint16_t mid;
     uint32_t high;
@@ -67,14 +68,21 @@ void vector33(void);
 void vector39(void);
 void vector40(void);
 void vector41(void);
+void vector255(void);
 void sysint(void);
 void init_idt(void);
+void load_idt_table(void);
 void eoi(void);
 void load_idt(struct IdtPtr *ptr);
 unsigned char read_isr(void);
 uint64_t read_cr2(void);
 uint64_t read_cr3(void);
+uint64_t read_cr4(void);
+void write_cr4(uint64_t value);
+void invlpg(uint64_t v);
+void halt(void);
 void TrapReturn(void);
+void ProcessStart(void);
 uint64_t get_ticks(void);
 
 #endif
@@ -0,0 +1,311 @@
+#include "vmalloc.h"
+#include "memory.h"
+#include "slab.h"
+#include "cpu.h"
+#include "lib.h"
+#include "debug.h"
+
+/*
+ * Virtually contiguous kernel memory built from single pages, for
+ * buffers and tables larger than the buddy allocator can hand out in
+ * one piece. The region has its own PML4 slot in the kernel map, so
+ * every address space sees the same mappings. An unmapped guard page
+ * follows each area, so nothing is mapped right below one either,
+ * which kernel stacks rely on. Page tables of the region are never
+ * freed.
+ */
+
+#define VMALLOC_GUARD SMALL_PAGE_SIZE
+
+struct VmallocArea {
+    uint64_t start;
+    uint64_t size;
+    struct VmallocArea *next;
+};
+
+static struct KmemCache *vmalloc_area_cache;
+static struct VmallocArea *vmalloc_areas;
+static struct SpinLock vmalloc_lock;
+
+static struct VmallocArea *find_area(uint64_t start, struct VmallocArea ***link)
+{
+    struct VmallocArea **p = &vmalloc_areas;
+
+    while (*p != NULL && (*p)->start != start)
+        p = &(*p)->next;
+
+    if (link != NULL)
+        *link = p;
+
+    return *p;
+}
+
+/* limit up to which the area may grow, keeping the guard page */
+static uint64_t area_limit(struct VmallocArea *area)
+{
+    uint64_t limit = area->next != NULL ? area->next->start : VMALLOC_END;
+
+    return limit - VMALLOC_GUARD;
+}
+
+static struct VmallocArea *reserve_area(uint64_t size)
+{
+    struct VmallocArea **link = &vmalloc_areas;
+    uint64_t start = VMALLOC_BASE;
+
+    while (*link != NULL) {
+        if ((*link)->start - start >= size + VMALLOC_GUARD)
+            break;
+        start = (*link)->start + (*link)->size + VMALLOC_GUARD;
+        link = &(*link)->next;
+    }
+
+    if (start + size + VMALLOC_GUARD > VMALLOC_END)
+        return NULL;
+
+    struct VmallocArea *area = kmem_cache_alloc(vmalloc_area_cache);
+    if (area == NULL)
+        return NULL;
+
+    area->start = start;
+    area->size = 0;
+    area->next = *link;
+    *link = area;
+
+    return area;
+}
+
+/* back [start, end) with zeroed pages, stops at the first failure */
+static uint64_t map_area_pages(uint64_t start, uint64_t end)
+{
+    uint64_t map = get_kernel_map();
+
+    for (; start < end; start += SMALL_PAGE_SIZE) {
+        void *page = kalloc_zeroed();
+        if (page == NULL)
+            break;
+        if (!map_pages(map, start, start + SMALL_PAGE_SIZE, V2P(page), PTE_P|PTE_W|PTE_G)) {
+            kfree((uint64_t)page);
+            break;
+        }
+    }
+
+    return start;
+}
+
+static bool unmap_leaf(uint64_t *entry, uint64_t va, uint64_t size, void *arg)
+{
+    struct Page **list = arg;
+
+    if (list != NULL) {
+        struct Page *page = (struct Page*)P2V(PDE_ADDR(*entry));
+        page->next = *list;
+        *list = page;
+    }
+    *entry = 0;
+
+    return true;
+}
+
+/* clear the entries of [start, end) and chain their pages on list */
+static void unmap_area_pages(uint64_t start, uint64_t end, struct Page **list)
+{
+    walk_page_range(get_kernel_map(), start, end, unmap_leaf, list);
+}
+
+struct Remap {
+    uint64_t from;
+    uint64_t to;
+    uint64_t done;
+};
+
+static bool remap_leaf(uint64_t *entry, uint64_t va, uint64_t size, void *arg)
+{
+    struct Remap *remap = arg;
+    uint64_t target = remap->to + (va - remap->from);
+
+    if (!map_pages(get_kernel_map(), target, target + size, PDE_ADDR(*entry), PTE_P|PTE_W|PTE_G))
+        return false;
+
+    remap->done = va + size - remap->from;
+    return true;
+}
+
+/* the range must not be reused until every CPU dropped it */
+static void release_pages(uint64_t start, uint64_t end, struct Page *list)
+{
+    tlb_shootdown(get_kernel_map(), start, end);
+
+    while (list != NULL) {
+        struct Page *page = list;
+        list = page->next;
+        kfree((uint64_t)page);
+    }
+}
+
+static void release_area(struct VmallocArea *area)
+{
+    struct VmallocArea **link;
+
+    spin_lock(&vmalloc_lock);
+    ASSERT(find_area(area->start, &link) == area);
+    *link = area->next;
+    spin_unlock(&vmalloc_lock);
+
+    kmem_cache_free(vmalloc_area_cache, area);
+}
+
+void *vmalloc(size_t size)
+{
+    struct VmallocArea *area;
+    struct Page *pages = NULL;
+
+    size = SPA_UP(size);
+    if (size == 0)
+        return NULL;
+
+    spin_lock(&vmalloc_lock);
+    area = reserve_area(size);
+    if (area != NULL) {
+        area->size = map_area_pages(area->start, area->start + size) - area->start;
+        if (area->size != size)
+            unmap_area_pages(area->start, area->start + area->size, &pages);
+    }
+    spin_unlock(&vmalloc_lock);
+
+    if (area == NULL)
+        return NULL;
+
+    if (area->size != size) {
+        release_pages(area->start, area->start + area->size, pages);
+        release_area(area);
+        return NULL;
+    }
+
+    return (void*)area->start;
+}
+
+void vfree(void *addr)
+{
+    struct VmallocArea *area;
+    struct Page *pages = NULL;
+
+    if (addr == NULL)
+        return;
+
+    spin_lock(&vmalloc_lock);
+    area = find_area((uint64_t)addr, NULL);
+    ASSERT(area != NULL);
+    unmap_area_pages(area->start, area->start + area->size, &pages);
+    spin_unlock(&vmalloc_lock);
+
+    release_pages(area->start, area->start + area->size, pages);
+    release_area(area);
+}
+
+/*
+ * Resize an area, keeping its contents. It grows in place when the
+ * addresses behind it are free. Otherwise the pages are mapped again
+ * at a new address without copying, and the new tail is added there.
+ */
+void *vrealloc(void *addr, size_t size)
+{
+    struct VmallocArea *area;
+    struct VmallocArea *moved = NULL;
+    struct Page *pages = NULL;
+    uint64_t old_start;
+    uint64_t old_size;
+
+    if (addr == NULL)
+        return vmalloc(size);
+
+    size = SPA_UP(size);
+    if (size == 0) {
+        vfree(addr);
+        return NULL;
+    }
+
+    spin_lock(&vmalloc_lock);
+    area = find_area((uint64_t)addr, NULL);
+    ASSERT(area != NULL);
+    old_start = area->start;
+    old_size = area->size;
+
+    if (size <= old_size) {
+        unmap_area_pages(old_start + size, old_start + old_size, &pages);
+        area->size = size;
+        spin_unlock(&vmalloc_lock);
+        release_pages(old_start + size, old_start + old_size, pages);
+        return addr;
+    }
+
+    if (old_start + size <= area_limit(area)) {
+        uint64_t end = map_area_pages(old_start + old_size, old_start + size);
+        bool done = end == old_start + size;
+        if (!done)
+            unmap_area_pages(old_start + old_size, end, &pages);
+        else
+            area->size = size;
+        spin_unlock(&vmalloc_lock);
+        if (!done) {
+            release_pages(old_start + old_size, end, pages);
+            return NULL;
+        }
+        return addr;
+    }
+
+    moved = reserve_area(size);
+    if (moved != NULL) {
+        struct Remap remap = { old_start, moved->start, 0 };
+        uint64_t remapped;
+
+        walk_page_range(get_kernel_map(), old_start, old_start + old_size, remap_leaf, &remap);
+        remapped = remap.done;
+        moved->size = remapped;
+
+        if (remapped == old_size)
+            moved->size = map_area_pages(moved->start + old_size, moved->start + size) - moved->start;
+
+        if (moved->size == size) {
+            unmap_area_pages(old_start, old_start + old_size, NULL);
+        } else {
+            unmap_area_pages(moved->start, moved->start + remapped, NULL);
+            unmap_area_pages(moved->start + remapped, moved->start + moved->size, &pages);
+        }
+    }
+    spin_unlock(&vmalloc_lock);
+
+    if (moved == NULL)
+        return NULL;
+
+    if (moved->size != size) {
+        /* the old frames stay with the old area, only the tail is freed */
+        release_pages(moved->start, moved->start + moved->size, pages);
+        release_area(moved);
+        return NULL;
+    }
+
+    release_pages(old_start, old_start + old_size, NULL);
+    release_area(area);
+
+    return (void*)moved->start;
+}
+
+size_t vmalloc_size(void *addr)
+{
+    struct VmallocArea *area;
+    size_t size = 0;
+
+    spin_lock(&vmalloc_lock);
+    area = find_area((uint64_t)addr, NULL);
+    if (area != NULL)
+        size = area->size;
+    spin_unlock(&vmalloc_lock);
+
+    return size;
+}
+
+void init_vmalloc(void)
+{
+    vmalloc_area_cache = kmem_cache_create("vmalloc_area", sizeof(struct VmallocArea));
+}
@@ -0,0 +1,13 @@
+#ifndef _VMALLOC_H_
+#define _VMALLOC_H_
+
+#include "stdint.h"
+#include "stddef.h"
+
+void init_vmalloc(void);
+void *vmalloc(size_t size);
+void *vrealloc(void *addr, size_t size);
+void vfree(void *addr);
+size_t vmalloc_size(void *addr);
+
+#endif
@@ -23,7 +23,10 @@ int ipv4_send(uint32_t dst_ip, uint8_t proto, const uint8_t *data, uint16_t len)
     uint8_t mac[6] = {0xff,0xff,0xff,0xff,0xff,0xff};
     arp_lookup(dst_ip, mac);
 
-    uint8_t frame[1500];
+    uint8_t *frame = alloc_packet();
+    if (frame == NULL)
+        return -1;
+
     struct eth_header *eth = (struct eth_header*)frame;
     memcpy(eth->dst, mac, 6);
     memcpy(eth->src, host_mac, 6);
@@ -55,7 +58,10 @@ int ipv4_send(uint32_t dst_ip, uint8_t proto, const uint8_t *data, uint16_t len)
 
     uint16_t total = sizeof(struct eth_header) + sizeof(struct ip_header) + len;
     memcpy(frame + sizeof(struct eth_header) + sizeof(struct ip_header), data, len);
-    return e1000_send(frame, total);
+    int ret = e1000_send(frame, total);
+    free_packet(frame);
+
+    return ret;
 }
 
 void ipv4_input(const uint8_t *pkt, uint16_t len)
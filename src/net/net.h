@@ -2,6 +2,8 @@
 #define _NET_H_
 #include <stdint.h>
 
+#define PACKET_SIZE 1600
+
 struct ip_header {
     uint8_t ihl:4;
     uint8_t version:4;
@@ -23,6 +25,9 @@ struct udp_header {
     uint16_t checksum;
 } __attribute__((packed));
 
+void* alloc_packet(void);
+void free_packet(void *pkt);
+
 void arp_init(void);
 void arp_insert(uint32_t ip, const uint8_t *mac);
 int arp_lookup(uint32_t ip, uint8_t *mac);
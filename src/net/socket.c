@@ -1,6 +1,7 @@
 #include "socket.h"
 #include "drivers/net/e1000.h"
 #include "kernel/print.h"
+#include "kernel/slab.h"
 #include "net.h"
 #include <string.h>
 
@@ -19,18 +20,34 @@ struct sock {
     int type;
 };
 
-static struct sock sockets[MAX_SOCKETS];
+static struct sock *sockets[MAX_SOCKETS];
+static struct KmemCache *socket_cache;
+static struct KmemCache *packet_cache;
+
+void* alloc_packet(void)
+{
+    return kmem_cache_alloc(packet_cache);
+}
+
+void free_packet(void *pkt)
+{
+    kmem_cache_free(packet_cache, pkt);
+}
 
 static void net_poll(void)
 {
-    uint8_t pkt[1600];
+    uint8_t *pkt;
     int n;
     struct eth_header { uint8_t dst[6]; uint8_t src[6]; uint16_t type; } __attribute__((packed));
 
     /* acknowledge any pending interrupts and fetch newly received frames */
     e1000_interrupt();
 
-    while ((n = e1000_receive(pkt, sizeof(pkt))) > 0) {
+    pkt = alloc_packet();
+    if (pkt == NULL)
+        return;
+
+    while ((n = e1000_receive(pkt, PACKET_SIZE)) > 0) {
         if (n < sizeof(struct eth_header))
             continue;
         struct eth_header *eth = (struct eth_header*)pkt;
@@ -40,14 +57,25 @@ static void net_poll(void)
             arp_input(pkt + sizeof(struct eth_header), n - sizeof(struct eth_header));
         }
     }
+
+    free_packet(pkt);
+}
+
+void init_socket(void)
+{
+    socket_cache = kmem_cache_create("socket", sizeof(struct sock));
+    packet_cache = kmem_cache_create("packet", PACKET_SIZE);
 }
 
 int socket_create(int type)
 {
     for (int i = 0; i < MAX_SOCKETS; i++) {
-        if (!sockets[i].used) {
-            sockets[i].used = 1;
-            sockets[i].type = type;
+        if (sockets[i] == NULL) {
+            sockets[i] = kmem_cache_alloc(socket_cache);
+            if (sockets[i] == NULL)
+                return -1;
+            sockets[i]->used = 1;
+            sockets[i]->type = type;
             return i;
         }
     }
@@ -56,9 +84,9 @@ int socket_create(int type)
 
 int socket_send(int sock, const void *buf, int len)
 {
-    if (sock < 0 || sock >= MAX_SOCKETS || !sockets[sock].used)
+    if (sock < 0 || sock >= MAX_SOCKETS || sockets[sock] == NULL)
         return -1;
-    switch (sockets[sock].type) {
+    switch (sockets[sock]->type) {
     case SOCK_DGRAM:
         /* send to the host machine at 192.168.0.1 */
         return udp_send(0xc0a80001, 1234, 1234, buf, len);
@@ -71,10 +99,10 @@ int socket_send(int sock, const void *buf, int len)
 
 int socket_recv(int sock, void *buf, int len)
 {
-    if (sock < 0 || sock >= MAX_SOCKETS || !sockets[sock].used)
+    if (sock < 0 || sock >= MAX_SOCKETS || sockets[sock] == NULL)
         return -1;
     net_poll();
-    switch (sockets[sock].type) {
+    switch (sockets[sock]->type) {
     case SOCK_DGRAM:
         return udp_receive(NULL, NULL, buf, len);
     case SOCK_STREAM:
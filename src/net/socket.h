@@ -6,6 +6,7 @@
 #define SOCK_DGRAM  1
 #define SOCK_STREAM 2
 
+void init_socket(void);
 int socket_create(int type);
 int socket_send(int sock, const void *buf, int len);
 int socket_recv(int sock, void *buf, int len);
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <lib.h>
+#include <stdint.h>
+
+#define MAX_PROCS 16
+#define MAP_PAGES 8
+
+static struct ProcStats procs[MAX_PROCS];
+
+/* the running process with our brk is us */
+static uint64_t get_shared_pages(void)
+{
+    uint64_t brk = (uint64_t)sbrk(0);
+    int count = get_proc_stats(procs, MAX_PROCS);
+
+    for (int i = 0; i < count; i++) {
+        if (procs[i].state == 2 && procs[i].brk == brk)
+            return procs[i].shared_pages;
+    }
+
+    return 0;
+}
+
+/*
+ * Pages of a read-only file mapping should be the frames of the FS
+ * image itself, which count as shared, rather than private copies.
+ */
+int main(void)
+{
+    volatile char *p;
+    uint64_t before, after;
+    int fd;
+
+    fd = open_file("KERNEL.ELF");
+    if (fd == -1) {
+        printf("open failed\n");
+        return 0;
+    }
+
+    p = mmap(fd, 0, MAP_PAGES * 4096, 0);
+    if (p == (void*)-1) {
+        printf("mmap failed\n");
+        close_file(fd);
+        return 0;
+    }
+
+    before = get_shared_pages();
+    for (int i = 0; i < MAP_PAGES; i++)
+        (void)p[i * 4096];
+    after = get_shared_pages();
+
+    printf("shared pages %u -> %u, %s\n", before, after,
+           after - before >= MAP_PAGES ? "mapped from the FS image" : "copied");
+
+    munmap((void*)p, MAP_PAGES * 4096);
+    close_file(fd);
+
+    return 0;
+}
@@ -0,0 +1,13 @@
+#include <stdio.h>
+#include <lib.h>
+
+/* the first run starts tracing, later runs dump what was traced so far */
+int main(void)
+{
+    if (alloc_trace(TRACE_DUMP) == 0) {
+        alloc_trace(TRACE_START);
+        printf("allocation tracing started\n");
+    }
+
+    return 0;
+}
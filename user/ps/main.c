@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <string.h>
+#include <lib.h>
+#include <stdint.h>
+
+#define MAX_PROCS 16
+
+static struct ProcStats procs[MAX_PROCS];
+
+static char *state_names[] = { "unused", "init", "run", "ready", "sleep", "zombie" };
+
+/* printf has no field widths, so pad by hand */
+static void print_column(char *text, int width)
+{
+    for (int len = strlen(text); len < width; len++)
+        printf(" ");
+    printf("%s", text);
+}
+
+static void print_number(uint64_t value, int width)
+{
+    char text[24];
+
+    snprintf(text, sizeof(text), "%u", value);
+    print_column(text, width);
+}
+
+static void print_kb(uint64_t pages, int width)
+{
+    char text[24];
+
+    snprintf(text, sizeof(text), "%uk", pages * 4);
+    print_column(text, width);
+}
+
+int main(void)
+{
+    struct MemStats mem;
+    int count;
+
+    get_mem_stats(&mem);
+    printf("memory: %uk total, %uk used, %uk free, %uk cached\n",
+           mem.total_pages * 4, mem.used_pages * 4, mem.free_pages * 4, mem.cached_pages * 4);
+    printf("swap store: %uk holding %uk\n", mem.store_pages * 4, mem.stored_pages * 4);
+    printf("kernel stack peak: %u bytes\n\n", mem.stack_peak);
+
+    count = get_proc_stats(procs, MAX_PROCS);
+
+    printf("  PID  STATE   TIME      RSS   SHARED     SWAP  TABLES   FAULTS     COW    ZERO  SWAPIN  STACK\n");
+    for (int i = 0; i < count; i++) {
+        struct ProcStats *p = &procs[i];
+        char *state = p->state >= 0 && p->state <= 5 ? state_names[p->state] : "?";
+
+        print_number(p->pid, 5);
+        print_column(state, 7);
+        print_number(p->runtime, 7);
+        print_kb(p->resident_pages, 9);
+        print_kb(p->shared_pages, 9);
+        print_kb(p->swapped_pages, 9);
+        print_kb(p->table_pages, 8);
+        print_number(p->minor_faults, 9);
+        print_number(p->cow_faults, 8);
+        print_number(p->zero_faults, 8);
+        print_number(p->swap_faults, 8);
+        print_number(p->stack_used, 7);
+        printf("\n");
+    }
+
+    return 0;
+}